@@ -0,0 +1,117 @@
+-- Compares the cost per sprite of the drawing functions. Copy this file to
+-- Content/Scripts/main.lua, put an image and a font into Content, set their names below and join
+-- with one player. Every variant runs for ROUNDS ticks, then the results are printed.
+--
+-- os.clock measures the processor time of the whole server, so run it with a single room and
+-- nothing else connected.
+
+local IMAGE = "sprite.png"
+local FONT = "font.ttf"
+local COUNT = 5000
+local ROUNDS = 50
+
+local function x(i)
+	return (i % 100) / 50 - 1
+end
+
+local function y(i)
+	return (i // 100) / 50 - 1
+end
+
+local prebuilt_list, prebuilt_packed, prebuilt_texts
+
+local variants = {
+	{ "draw_sprite loop", function(player)
+		for i = 1, COUNT do
+			draw_sprite(player, IMAGE, x(i), y(i), 0.01)
+		end
+	end },
+	{ "draw_sprite loop, handle", function(player)
+		local sprite = image(IMAGE)
+		for i = 1, COUNT do
+			draw_sprite(player, sprite, x(i), y(i), 0.01)
+		end
+	end },
+	{ "draw_sprites, list incl. building", function(player)
+		local list = {}
+		for i = 1, COUNT do
+			list[i] = { IMAGE, x(i), y(i), 0.01 }
+		end
+		draw_sprites(player, list)
+	end },
+	{ "draw_sprites, list call only", function(player)
+		draw_sprites(player, prebuilt_list)
+	end },
+	{ "draw_sprites, packed incl. packing", function(player)
+		local parts = {}
+		for i = 1, COUNT do
+			parts[i] = string.pack("fff", x(i), y(i), 0.01)
+		end
+		draw_sprites(player, IMAGE, table.concat(parts))
+	end },
+	{ "draw_sprites, packed call only", function(player)
+		draw_sprites(player, IMAGE, prebuilt_packed)
+	end },
+	{ "draw_text loop", function(player)
+		for i = 1, COUNT do
+			draw_text(player, FONT, x(i), y(i), 0.01, 255, 255, 255, "text")
+		end
+	end },
+	{ "draw_texts, list incl. building", function(player)
+		local list = {}
+		for i = 1, COUNT do
+			list[i] = { FONT, x(i), y(i), 0.01, 255, 255, 255, "text" }
+		end
+		draw_texts(player, list)
+	end },
+	{ "draw_texts, list call only", function(player)
+		draw_texts(player, prebuilt_texts)
+	end }
+}
+
+local player = nil
+local variant = 1
+local round = 0
+local results = {}
+
+function on_join(joined)
+	player = joined
+	prebuilt_list, prebuilt_texts = {}, {}
+	local parts = {}
+	for i = 1, COUNT do
+		prebuilt_list[i] = { IMAGE, x(i), y(i), 0.01 }
+		prebuilt_texts[i] = { FONT, x(i), y(i), 0.01, 255, 255, 255, "text" }
+		parts[i] = string.pack("fff", x(i), y(i), 0.01)
+	end
+	prebuilt_packed = table.concat(parts)
+end
+
+function on_quit(left)
+	if left == player then
+		player = nil
+	end
+end
+
+function on_tick(dt)
+	if player == nil then
+		return
+	end
+	local start = os.clock()
+	variants[variant][2](player)
+	results[variant] = (results[variant] or 0) + os.clock() - start
+	round = round + 1
+	if round < ROUNDS then
+		return
+	end
+	round = 0
+	variant = variant + 1
+	if variant > #variants then
+		variant = 1
+		print(string.format("%d sprites per tick, %d ticks per variant:", COUNT, ROUNDS))
+		for i, entry in ipairs(variants) do
+			print(string.format("  %-36s %8.0f ns/sprite", entry[1],
+				results[i] / (COUNT * ROUNDS) * 1e9))
+		end
+		results = {}
+	end
+end
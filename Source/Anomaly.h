@@ -3,6 +3,7 @@
 #ifndef ANOMALY_ANOMALY_H
 #define ANOMALY_ANOMALY_H
 
+#include <cstring>
 #include <string>
 
 enum class ContentType {
@@ -11,6 +12,22 @@ enum class ContentType {
 	SOUND
 };
 
+// Content is announced in a manifest the first time a client uses it, clients request the blobs
+// they do not have cached by hash and offset, and receive them in chunks. Updates after a reload
+// only concern content a client knows.
+enum class ContentPacket {
+	MANIFEST,
+	CHUNK,
+	UPDATE
+};
+
+struct ContentEntry {
+	ContentType type;
+	uint32_t id;
+	uint64_t hash;
+	uint32_t size;
+};
+
 struct Sprite {
 	bool is_text;
 	uint32_t id;
@@ -38,6 +55,23 @@ struct AudioCommand {
 	} type;
 };
 
+// Sprite frames are sent as runs of sprites that changed in the same way compared to the same
+// index in an earlier frame, so that a frame where nothing moved costs almost nothing
+enum class SpriteDelta {
+	UNCHANGED,
+	MOVED,
+	REPLACED
+};
+
+// Changes to retained sprites are sent reliably after a byte with the fraction bits of the
+// positions, each as varint(handle << 2 | op) followed by the data of the operation
+enum class RetainedOp {
+	CREATE,
+	POSITION,
+	VISIBILITY,
+	DESTROY
+};
+
 enum class InputEventType {
 	UP,
 	DOWN,
@@ -56,12 +90,35 @@ inline void write32(uint8_t* area, uint32_t i) {
 	area[3] = (i & 0x000000FF);
 }
 
+inline void write64(uint8_t* area, uint64_t i) {
+	write32(area, static_cast<uint32_t>(i >> 32));
+	write32(area + 4, static_cast<uint32_t>(i));
+}
+
 inline void write_float(uint8_t* area, float f) {
 	uint32_t val;
 	memcpy(&val, &f, sizeof(float));
 	write32(area, val);
 }
 
+// Unsigned LEB128, at most 5 bytes
+inline size_t write_varint(uint8_t* area, uint32_t i) {
+	size_t length = 0;
+	while (i >= 0x80) {
+		area[length++] = static_cast<uint8_t>(i | 0x80);
+		i >>= 7;
+	}
+	area[length++] = static_cast<uint8_t>(i);
+	return length;
+}
+
+// Signed 16 bit fixed point, values out of range are clamped
+inline uint16_t to_fixed(float f, uint8_t fraction_bits) {
+	float scaled = f * static_cast<float>(1 << fraction_bits);
+	scaled = scaled < -32768.0f ? -32768.0f : (scaled > 32767.0f ? 32767.0f : scaled);
+	return static_cast<uint16_t>(static_cast<int16_t>(scaled < 0.0f ? scaled - 0.5f : scaled + 0.5f));
+}
+
 inline uint16_t read16(uint8_t* area) {
 	return (area[0] << 8) | area[1];
 }
@@ -70,6 +127,10 @@ inline uint32_t read32(uint8_t* area) {
 	return (area[0] << 24) | (area[1] << 16) | (area[2] << 8) | area[3];
 }
 
+inline uint64_t read64(uint8_t* area) {
+	return static_cast<uint64_t>(read32(area)) << 32 | read32(area + 4);
+}
+
 inline float read_float(uint8_t* area) {
 	uint32_t val = read32(area);
 	float result;
@@ -77,16 +138,113 @@ inline float read_float(uint8_t* area) {
 	return result;
 }
 
+inline size_t read_varint(uint8_t* area, uint32_t& i) {
+	size_t length = 0;
+	i = 0;
+	do {
+		i |= static_cast<uint32_t>(area[length] & 0x7F) << (7 * length);
+	} while (area[length++] & 0x80 && length < 5);
+	return length;
+}
+
+// Stops at end, returns 0 if the varint is cut off there
+inline size_t read_varint(uint8_t* area, uint8_t* end, uint32_t& i) {
+	size_t length = 0;
+	i = 0;
+	do {
+		if (area + length >= end) {
+			return 0;
+		}
+		i |= static_cast<uint32_t>(area[length] & 0x7F) << (7 * length);
+	} while (area[length++] & 0x80 && length < 5);
+	return length;
+}
+
+inline float read_fixed(uint8_t* area, uint8_t fraction_bits) {
+	return static_cast<int16_t>(read16(area)) / static_cast<float>(1 << fraction_bits);
+}
+
+// MurmurHash64A, content is identified by this hash in the client's cache
+inline uint64_t hash_content(const uint8_t* data, size_t length) {
+	const uint64_t m = 0xC6A4A7935BD1E995ULL;
+	uint64_t h = length * m;
+	size_t blocks = length / 8;
+	for (size_t i = 0; i < blocks; ++i) {
+		// Read as little endian, so that every platform gets the same hash
+		uint64_t k = 0;
+		for (size_t j = 0; j < 8; ++j) {
+			k |= static_cast<uint64_t>(data[8 * i + j]) << (8 * j);
+		}
+		k *= m;
+		k ^= k >> 47;
+		k *= m;
+		h ^= k;
+		h *= m;
+	}
+	const uint8_t* tail = data + 8 * blocks;
+	size_t remaining = length & 7;
+	if (remaining > 0) {
+		for (size_t i = remaining; i > 0; --i) {
+			h ^= static_cast<uint64_t>(tail[i - 1]) << (8 * (i - 1));
+		}
+		h *= m;
+	}
+	h ^= h >> 47;
+	h *= m;
+	h ^= h >> 47;
+	return h;
+}
+
 constexpr uint64_t CONTENT_RELOAD = 1000;
+// [type][id][hash][size] per entry of a manifest
+constexpr size_t MANIFEST_ENTRY_SIZE = 17;
+constexpr size_t CONTENT_TYPES = 3;
+// Small enough that a chunk is never fragmented
+constexpr uint32_t CONTENT_CHUNK_SIZE = 1024;
+// No more chunks are sent while this many bytes of content are still unacknowledged by a client
+constexpr uint64_t CONTENT_WINDOW = 65536;
+
+constexpr size_t INITIAL_SPRITE_CAPACITY = 64;
+constexpr uint32_t SPRITE_HISTORY = 32;
+// Acknowledgements of the shared layer carry one bit per frame of the history
+static_assert(SPRITE_HISTORY <= 32);
+constexpr uint8_t SPRITE_DELTA_RUN = 64;
+// Stored in the lowest bits of a sprite's ID
+constexpr uint32_t SPRITE_TEXT = 1;
+constexpr uint32_t SPRITE_COLOR = 2;
+constexpr uint32_t SPRITE_FLAG_BITS = 2;
+// Texts are stored in a per-client table, slot 0 is never stored
+constexpr uint16_t STRING_TABLE_SIZE = 256;
+constexpr size_t STRING_TABLE_MAX_LENGTH = 128;
+
+// Scripts can name content by handles, which are the ID shifted left by this, with the content
+// type in the low bits
+constexpr uint32_t CONTENT_HANDLE_BITS = 2;
 
-constexpr uint16_t MAX_CLIENTS = 32;
+constexpr uint32_t RETAINED_OP_BITS = 2;
+constexpr uint32_t MAX_RETAINED_SPRITES = 65536;
 
-constexpr uint16_t NET_CHANNELS = 5;
+constexpr size_t PROFILER_WINDOW = 1024;
+constexpr uint32_t PROFILE_POLL_INTERVAL = 250;
+constexpr double SCRIPT_PROFILE_WRITE_INTERVAL = 10.0;
+
+constexpr uint16_t NET_CHANNELS = 9;
 constexpr uint16_t INPUT_CHANNEL = 0;
 constexpr uint16_t COMMAND_CHANNEL = 1;
 constexpr uint16_t SPRITE_CHANNEL = 2;
 constexpr uint16_t CONTENT_CHANNEL = 3;
 constexpr uint16_t AUDIO_CHANNEL = 4;
+constexpr uint16_t ACK_CHANNEL = 5;
+constexpr uint16_t SHARED_CHANNEL = 6;
+constexpr uint16_t RETAINED_CHANNEL = 7;
+constexpr uint16_t MOTION_CHANNEL = 8;
+
+// Pointer motion is sent unreliably, every sample is repeated in this many packets so that
+// losing a packet does not lose the motion
+constexpr uint32_t INPUT_REDUNDANCY = 3;
+// Presses and releases wait at most this many milliseconds for the motion sampled before them,
+// in case every copy of it was lost
+constexpr uint32_t INPUT_ORDER_TIMEOUT = 100;
 
 constexpr uint16_t ANOMALY_AUDIO_CHANNELS = 16;
 
@@ -95,5 +253,21 @@ constexpr int FONT_SDF_PADDING = 10;
 constexpr int FONT_SDF_SCALE = 20;
 
 constexpr double MINIMUM_FRAME_TIME = 0.03;
+// Only limits rendering if the display does not support vsync
+constexpr double MINIMUM_RENDER_TIME = 0.004;
+// Frames are shown late enough that a later frame has usually arrived to interpolate towards
+constexpr double MAX_INTERPOLATION_DELAY = 0.25;
+// Sprites that moved further than this between two frames jump instead of sliding across
+constexpr float INTERPOLATION_SNAP_DISTANCE = 0.5f;
+constexpr double CLOCK_RESYNC_THRESHOLD = 0.5;
+constexpr double CLOCK_SMOOTHING = 0.05;
+
+constexpr uint32_t IDLE_SERVICE_TIMEOUT = 1000;
+// The network thread wakes up for queued packets and incoming datagrams, the timeout only bounds
+// how late ENet notices lost packets while anyone is connected
+constexpr uint32_t NETWORK_SERVICE_TIMEOUT = 10;
+// Used instead if the network thread can not be woken up
+constexpr uint32_t NETWORK_POLL_TIMEOUT = 1;
+constexpr uint32_t NET_STATS_INTERVAL = 250;
 
 #endif
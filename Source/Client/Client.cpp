@@ -1,5 +1,10 @@
 // Copyright 2023 Justus Zorn
 
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+
 #include <Anomaly.h>
 #include <Client/Client.h>
 
@@ -15,6 +20,13 @@ Client::Client(Window& window) {
 		window.error("Could not create network socket");
 		throw std::exception();
 	}
+	compressor.install(host);
+	// Only the player's own layer has a string table, shared texts are always sent inline
+	layer.strings.resize(STRING_TABLE_SIZE + 1);
+	if (char* path = SDL_GetPrefPath("Anomaly", "Cache")) {
+		cache_path = path;
+		SDL_free(path);
+	}
 }
 
 Client::~Client() {
@@ -25,14 +37,26 @@ Client::~Client() {
 	enet_deinitialize();
 }
 
-bool Client::connect(Window& window, const std::string& hostname, uint16_t port) {
+bool Client::connect(Window& window, const std::string& hostname, uint16_t port, uint32_t room) {
 	ENetAddress address = { 0 };
 	if (enet_address_set_host(&address, hostname.c_str()) < 0) {
 		window.error("Could not resolve hostname '" + hostname + "'");
 		return false;
 	}
 	address.port = port;
-	peer = enet_host_connect(host, &address, NET_CHANNELS, 0);
+	// Cached files are prefixed with the server, so that a server can not plant content for
+	// another one under the same hash
+	if (!cache_path.empty()) {
+		std::string server = hostname + '-' + std::to_string(port) + '-';
+		for (char& c : server) {
+			if (!std::isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-') {
+				c = '_';
+			}
+		}
+		cache_path += server;
+	}
+	peer = enet_host_connect(host, &address, NET_CHANNELS,
+		(room & CONNECT_ROOM_MASK) | SUPPORTED_CODECS << CONNECT_CODEC_SHIFT);
 	ENetEvent event;
 	if (enet_host_service(host, &event, 5000) > 0 && event.type == ENET_EVENT_TYPE_CONNECT) {
 		uint8_t login_packet[] = {
@@ -53,19 +77,32 @@ bool Client::connect(Window& window, const std::string& hostname, uint16_t port)
 }
 
 bool Client::update(Audio& audio, Renderer& renderer) {
+	// Input refers to the motion sent so far, motion since then is sent after it
 	ENetPacket* input_packet = renderer.get_window().create_input_packet();
 	if (input_packet) {
 		enet_peer_send(peer, INPUT_CHANNEL, input_packet);
 	}
+	ENetPacket* motion_packet = renderer.get_window().create_motion_packet();
+	if (motion_packet) {
+		enet_peer_send(peer, MOTION_CHANNEL, motion_packet);
+	}
 	ENetEvent event;
+	bool received_frame = false;
 	while (enet_host_service(host, &event, 0) > 0) {
 		switch (event.type) {
 		case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
 		case ENET_EVENT_TYPE_DISCONNECT:
 			return false;
 		case ENET_EVENT_TYPE_RECEIVE:
-			if (event.channelID == SPRITE_CHANNEL) {
-				draw(renderer, event.packet);
+			if (event.channelID == SPRITE_CHANNEL || event.channelID == SHARED_CHANNEL) {
+				Layer& current = event.channelID == SPRITE_CHANNEL ? layer : shared_layer;
+				if (decode_sprites(current, event.packet)) {
+					sync_clock(current.history[current.latest % SPRITE_HISTORY].time);
+					received_frame = true;
+				}
+			}
+			else if (event.channelID == RETAINED_CHANNEL) {
+				update_retained(event.packet);
 			}
 			else if (event.channelID == COMMAND_CHANNEL) {
 				handle_commands(renderer, event.packet);
@@ -80,34 +117,298 @@ bool Client::update(Audio& audio, Renderer& renderer) {
 			break;
 		}
 	}
+	if (received_frame) {
+		// The shared layer is delta encoded against a frame every player of the room holds, so
+		// all held frames are acknowledged
+		uint32_t held = 0;
+		for (uint32_t age = 1; age < SPRITE_HISTORY && age < shared_layer.latest; ++age) {
+			uint32_t number = shared_layer.latest - age;
+			if (shared_layer.history[number % SPRITE_HISTORY].number == number) {
+				held |= 1u << age;
+			}
+		}
+		uint8_t ack[12];
+		write32(ack, layer.latest);
+		write32(ack + 4, shared_layer.latest);
+		write32(ack + 8, held);
+		enet_peer_send(peer, ACK_CHANNEL, enet_packet_create(ack, sizeof(ack), 0));
+	}
 	return true;
 }
 
-void Client::draw(Renderer& renderer, ENetPacket* packet) {
+void Client::render(Renderer& renderer) {
+	double now = local_time();
+	if (clock_synced) {
+		// The playback clock runs at local speed and is pulled towards the target gently, so
+		// that jitter does not show up as jerky motion
+		double delay = std::min(frame_interval + 2.0 * jitter, MAX_INTERPOLATION_DELAY);
+		double target = now + clock_offset - delay;
+		playback_time += now - last_render;
+		if (std::abs(target - playback_time) > CLOCK_RESYNC_THRESHOLD) {
+			playback_time = target;
+		}
+		else {
+			playback_time += (target - playback_time) * CLOCK_SMOOTHING;
+		}
+	}
+	last_render = now;
 	renderer.clear(0.0f, 0.0f, 0.0f);
-	uint32_t length = read32(packet->data);
-	uint8_t* data = packet->data + 4;
-	for (uint32_t i = 0; i < length; ++i) {
-		uint32_t id = read32(data);
-		float x = read_float(data + 4);
-		float y = read_float(data + 8);
-		float scale = read_float(data + 12);
-		if (id & 0x80000000) {
-			uint8_t r, g, b;
-			r = data[16];
-			g = data[17];
-			b = data[18];
-			uint32_t length = read32(data + 19);
-			renderer.draw_text(id & ~0x80000000, x, y, scale, r, g, b, data + 23, length);
-			data += 23;
+	draw_layer(renderer, interpolate(shared_layer));
+	// Retained sprites are drawn between the shared layer and the player's own layer
+	for (const RetainedSprite& sprite : retained) {
+		if (sprite.id != 0 && sprite.visible) {
+			renderer.draw_sprite(sprite.id, sprite.x, sprite.y, sprite.scale);
+		}
+	}
+	draw_layer(renderer, interpolate(layer));
+	if (download_total > 0) {
+		renderer.draw_progress(static_cast<float>(download_received) /
+			static_cast<float>(download_total));
+	}
+	renderer.present();
+}
+
+static uint8_t* read_position(uint8_t* data, Sprite& sprite, uint8_t fraction_bits) {
+	sprite.x = read_fixed(data, fraction_bits);
+	sprite.y = read_fixed(data + 2, fraction_bits);
+	sprite.scale = read_fixed(data + 4, fraction_bits);
+	return data + 6;
+}
+
+static uint8_t* read_sprite(uint8_t* data, Sprite& sprite, uint8_t fraction_bits,
+	std::vector<std::string>& strings) {
+	uint32_t id;
+	data += read_varint(data, id);
+	sprite.is_text = id & SPRITE_TEXT;
+	sprite.id = id >> SPRITE_FLAG_BITS;
+	data = read_position(data, sprite, fraction_bits);
+	sprite.r = sprite.g = sprite.b = 255;
+	if (id & SPRITE_COLOR) {
+		sprite.r = data[0];
+		sprite.g = data[1];
+		sprite.b = data[2];
+		data += 3;
+	}
+	sprite.text.clear();
+	if (sprite.is_text) {
+		uint32_t reference;
+		data += read_varint(data, reference);
+		uint32_t slot = reference >> 1;
+		if (reference & 1) {
+			uint32_t length;
+			data += read_varint(data, length);
+			sprite.text.assign(reinterpret_cast<const char*>(data), length);
+			data += length;
+			if (slot != 0 && slot < strings.size()) {
+				strings[slot] = sprite.text;
+			}
+		}
+		else if (slot < strings.size()) {
+			sprite.text = strings[slot];
+		}
+	}
+	return data;
+}
+
+bool Client::decode_sprites(Layer& layer, ENetPacket* packet) {
+	uint32_t number = read32(packet->data);
+	uint32_t baseline = read32(packet->data + 4);
+	double time = read32(packet->data + 8) / 1000.0;
+	uint8_t fraction_bits = packet->data[12];
+	uint32_t length;
+	uint8_t* data = packet->data + 13;
+	data += read_varint(data, length);
+	const std::vector<Sprite>* base = nullptr;
+	if (baseline != 0) {
+		base = &layer.history[baseline % SPRITE_HISTORY].sprites;
+		if (layer.history[baseline % SPRITE_HISTORY].number != baseline) {
+			return false;
+		}
+	}
+	std::vector<Sprite>& decoded = layer.decoded;
+	decoded.resize(length);
+	uint32_t i = 0;
+	while (i < length) {
+		SpriteDelta delta = static_cast<SpriteDelta>(data[0] >> 6);
+		uint32_t run = (data[0] & (SPRITE_DELTA_RUN - 1)) + 1;
+		++data;
+		for (uint32_t end = std::min(i + run, length); i < end; ++i) {
+			if (delta == SpriteDelta::REPLACED) {
+				data = read_sprite(data, decoded[i], fraction_bits, layer.strings);
+			}
+			else if (base == nullptr || i >= base->size()) {
+				return false;
+			}
+			else {
+				decoded[i] = (*base)[i];
+				if (delta == SpriteDelta::MOVED) {
+					data = read_position(data, decoded[i], fraction_bits);
+				}
+			}
+		}
+	}
+	Snapshot& snapshot = layer.history[number % SPRITE_HISTORY];
+	snapshot.number = number;
+	snapshot.time = time;
+	std::swap(snapshot.sprites, decoded);
+	layer.latest = number;
+	return true;
+}
+
+void Client::update_retained(ENetPacket* packet) {
+	if (packet->dataLength < 1) {
+		return;
+	}
+	uint8_t fraction_bits = packet->data[0];
+	uint8_t* data = packet->data + 1;
+	uint8_t* end = packet->data + packet->dataLength;
+	// A malformed packet is dropped at the first operation that does not fit
+	while (data < end) {
+		uint32_t reference;
+		size_t length = read_varint(data, end, reference);
+		if (length == 0) {
+			return;
+		}
+		data += length;
+		uint32_t handle = reference >> RETAINED_OP_BITS;
+		RetainedOp op = static_cast<RetainedOp>(reference & ((1 << RETAINED_OP_BITS) - 1));
+		if (handle == 0 || handle > MAX_RETAINED_SPRITES) {
+			return;
+		}
+		if (handle > retained.size()) {
+			retained.resize(handle, { 0, 0.0f, 0.0f, 0.0f, false });
+		}
+		RetainedSprite& sprite = retained[handle - 1];
+		if (op == RetainedOp::CREATE) {
+			length = read_varint(data, end, sprite.id);
+			if (length == 0) {
+				sprite.id = 0;
+				return;
+			}
 			data += length;
 		}
+		if (op == RetainedOp::CREATE || op == RetainedOp::POSITION) {
+			if (end - data < 6) {
+				return;
+			}
+			sprite.x = read_fixed(data, fraction_bits);
+			sprite.y = read_fixed(data + 2, fraction_bits);
+			sprite.scale = read_fixed(data + 4, fraction_bits);
+			data += 6;
+		}
+		if (op == RetainedOp::CREATE || op == RetainedOp::VISIBILITY) {
+			if (data == end) {
+				return;
+			}
+			sprite.visible = *(data++);
+		}
+		if (op == RetainedOp::DESTROY) {
+			sprite.id = 0;
+		}
+	}
+}
+
+double Client::local_time() const {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Client::sync_clock(double time) {
+	double sample = time - local_time();
+	if (!clock_synced || std::abs(sample - clock_offset) > CLOCK_RESYNC_THRESHOLD) {
+		// First frame, or the server's clock jumped (it does not simulate without players)
+		clock_synced = true;
+		clock_offset = sample;
+		jitter = 0.0;
+		playback_time = sample + local_time() - frame_interval;
+		last_frame_time = time;
+		return;
+	}
+	if (time > last_frame_time) {
+		// Frames are only sent after a whole tick, so intervals vary and the longest one counts
+		double interval = time - last_frame_time;
+		frame_interval = std::max(interval, frame_interval + (interval - frame_interval) * CLOCK_SMOOTHING);
+		last_frame_time = time;
+	}
+	// The fastest frame has the least delay, later frames only pull the offset back slowly
+	// so that it can follow a slower server clock
+	if (sample > clock_offset) {
+		clock_offset = sample;
+	}
+	else {
+		clock_offset += (sample - clock_offset) * CLOCK_SMOOTHING * CLOCK_SMOOTHING;
+	}
+	jitter += (clock_offset - sample - jitter) * CLOCK_SMOOTHING;
+}
+
+// Sprites are only the same between frames if they are drawn at the same position of the draw
+// calls and look the same, anything else is shown as it is
+static bool same_sprite(const Sprite& a, const Sprite& b) {
+	return a.is_text == b.is_text && a.id == b.id && a.r == b.r && a.g == b.g && a.b == b.b &&
+		a.text == b.text;
+}
+
+void Client::match_sprites(Layer& layer, const Snapshot& from, const Snapshot& to) {
+	layer.matches.resize(to.sprites.size());
+	for (size_t i = 0; i < to.sprites.size(); ++i) {
+		const Sprite& a = to.sprites[i];
+		bool matched = i < from.sprites.size() && same_sprite(from.sprites[i], a) &&
+			std::abs(from.sprites[i].x - a.x) + std::abs(from.sprites[i].y - a.y) <
+			INTERPOLATION_SNAP_DISTANCE;
+		layer.matches[i] = matched ? static_cast<uint32_t>(i) : UINT32_MAX;
+	}
+	layer.matched_from = from.number;
+	layer.matched_to = to.number;
+}
+
+const std::vector<Sprite>& Client::interpolate(Layer& layer) {
+	const Snapshot& latest = layer.history[layer.latest % SPRITE_HISTORY];
+	// The frames right before and after the playback time, the history serves as jitter buffer
+	const Snapshot* from = nullptr;
+	const Snapshot* to = nullptr;
+	for (const Snapshot& snapshot : layer.history) {
+		if (snapshot.number == 0 || snapshot.number > layer.latest) {
+			continue;
+		}
+		if (snapshot.time <= playback_time) {
+			if (from == nullptr || snapshot.time > from->time) {
+				from = &snapshot;
+			}
+		}
+		else if (to == nullptr || snapshot.time < to->time) {
+			to = &snapshot;
+		}
+	}
+	if (from == nullptr || to == nullptr) {
+		// Too far behind or ahead of the received frames, so there is nothing to interpolate
+		return to != nullptr ? to->sprites : latest.sprites;
+	}
+	if (layer.matched_from != from->number || layer.matched_to != to->number) {
+		match_sprites(layer, *from, *to);
+	}
+	float t = static_cast<float>((playback_time - from->time) / (to->time - from->time));
+	layer.interpolated = to->sprites;
+	for (size_t i = 0; i < layer.interpolated.size(); ++i) {
+		if (layer.matches[i] != UINT32_MAX) {
+			const Sprite& a = from->sprites[layer.matches[i]];
+			Sprite& b = layer.interpolated[i];
+			b.x = a.x + (b.x - a.x) * t;
+			b.y = a.y + (b.y - a.y) * t;
+			b.scale = a.scale + (b.scale - a.scale) * t;
+		}
+	}
+	return layer.interpolated;
+}
+
+void Client::draw_layer(Renderer& renderer, const std::vector<Sprite>& sprites) {
+	for (const Sprite& sprite : sprites) {
+		if (sprite.is_text) {
+			renderer.draw_string(sprite.id, sprite.x, sprite.y, sprite.scale, sprite.r, sprite.g,
+				sprite.b, sprite.text);
+		}
 		else {
-			renderer.draw_sprite(id, x, y, scale);
-			data += 16;
+			renderer.draw_sprite(sprite.id, sprite.x, sprite.y, sprite.scale);
 		}
 	}
-	renderer.present();
 }
 
 void Client::handle_commands(Renderer& renderer, ENetPacket* packet) {
@@ -138,18 +439,205 @@ void Client::handle_audio(Audio& audio, ENetPacket* packet) {
 }
 
 void Client::update_content(Audio& audio, Renderer& renderer, ENetPacket* packet) {
-	uint32_t id = read32(packet->data + 1);
-	uint32_t length = read32(packet->data + 5);
-	if (packet->data[0] == static_cast<uint8_t>(ContentType::IMAGE)) {
-		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Received content update (image ID %u)", id);
-		renderer.load_image(id, packet->data + 9, length);
+	if (packet->data[0] == static_cast<uint8_t>(ContentPacket::MANIFEST) ||
+		packet->data[0] == static_cast<uint8_t>(ContentPacket::UPDATE)) {
+		bool is_update = packet->data[0] == static_cast<uint8_t>(ContentPacket::UPDATE);
+		uint32_t count = read32(packet->data + 1);
+		std::vector<uint8_t> request(4);
+		std::vector<uint8_t> data;
+		for (uint32_t i = 0; i < count; ++i) {
+			uint8_t* entry_data = packet->data + 5 + MANIFEST_ENTRY_SIZE * i;
+			ContentEntry entry = { static_cast<ContentType>(entry_data[0]), read32(entry_data + 1),
+				read64(entry_data + 5), read32(entry_data + 13) };
+			uint64_t key = static_cast<uint64_t>(entry.type) << 32 | entry.id;
+			auto known = content_hashes.find(key);
+			if (known == content_hashes.end() ? is_update : known->second == entry.hash) {
+				// Content that is not used yet, or that is announced again unchanged
+				continue;
+			}
+			if (known != content_hashes.end()) {
+				// The old version is not needed anymore if it has not arrived yet
+				auto old = downloads.find(known->second);
+				if (old != downloads.end()) {
+					std::vector<ContentEntry>& entries = old->second.entries;
+					entries.erase(std::remove_if(entries.begin(), entries.end(),
+						[&entry](const ContentEntry& waiting) {
+							return waiting.type == entry.type && waiting.id == entry.id;
+						}), entries.end());
+					if (entries.empty()) {
+						download_total -= old->second.size;
+						download_received -= old->second.data.size();
+						remove_partial(old->first);
+						downloads.erase(old);
+					}
+				}
+			}
+			content_hashes[key] = entry.hash;
+			if (read_cache(entry.hash, entry.size, data)) {
+				load_content(audio, renderer, entry, data.data(), true);
+				continue;
+			}
+			// Identical files are only requested once
+			auto [it, inserted] = downloads.try_emplace(entry.hash);
+			Download& download = it->second;
+			download.entries.push_back(entry);
+			if (inserted) {
+				download.size = entry.size;
+				read_partial(entry.hash, entry.size, download.data);
+				download_total += download.size;
+				download_received += download.data.size();
+				size_t offset = request.size();
+				request.resize(offset + 12);
+				write64(request.data() + offset, entry.hash);
+				write32(request.data() + offset + 8, static_cast<uint32_t>(download.data.size()));
+			}
+		}
+		if (request.size() > 4) {
+			write32(request.data(), static_cast<uint32_t>((request.size() - 4) / 12));
+			enet_peer_send(peer, CONTENT_CHANNEL, enet_packet_create(request.data(),
+				request.size(), ENET_PACKET_FLAG_RELIABLE));
+		}
+	}
+	else if (packet->data[0] == static_cast<uint8_t>(ContentPacket::CHUNK)) {
+		uint64_t hash = read64(packet->data + 1);
+		uint32_t size = read32(packet->data + 9);
+		uint32_t offset = read32(packet->data + 13);
+		const uint8_t* data = packet->data + 17;
+		uint32_t length = static_cast<uint32_t>(packet->dataLength - 17);
+		auto it = downloads.find(hash);
+		// Chunks of abandoned downloads, or of a request that was sent twice, are dropped
+		if (it == downloads.end() || size != it->second.size ||
+			offset != it->second.data.size() || length > size - offset) {
+			return;
+		}
+		Download& download = it->second;
+		download.data.insert(download.data.end(), data, data + length);
+		download_received += length;
+		if (download.data.size() < download.size) {
+			append_partial(hash, data, length);
+			return;
+		}
+		remove_partial(hash);
+		if (hash_content(download.data.data(), download.size) != hash) {
+			// Most likely the partial file was damaged, start over
+			download_received -= download.size;
+			download.data.clear();
+			request_chunks(hash, 0);
+			return;
+		}
+		write_cache(hash, download.data.data(), download.size);
+		for (const ContentEntry& entry : download.entries) {
+			load_content(audio, renderer, entry, download.data.data(), false);
+		}
+		downloads.erase(it);
+		if (downloads.empty()) {
+			download_total = 0;
+			download_received = 0;
+		}
+	}
+}
+
+void Client::load_content(Audio& audio, Renderer& renderer, const ContentEntry& entry,
+	const uint8_t* data, bool cached) {
+	const char* source = cached ? "Loaded cached" : "Received";
+	if (entry.type == ContentType::IMAGE) {
+		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "%s content (image ID %u)", source, entry.id);
+		renderer.load_image(entry.id, data, entry.size);
+	}
+	else if (entry.type == ContentType::FONT) {
+		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "%s content (font ID %u)", source, entry.id);
+		renderer.load_font(entry.id, data, entry.size);
+	}
+	else if (entry.type == ContentType::SOUND) {
+		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "%s content (sound ID %u)", source, entry.id);
+		audio.load_sound(entry.id, data, entry.size);
+	}
+}
+
+static std::string cache_file(const std::string& cache_path, uint64_t hash) {
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+	return cache_path + name;
+}
+
+static std::string partial_file(const std::string& cache_path, uint64_t hash) {
+	return cache_file(cache_path, hash) + ".part";
+}
+
+bool Client::read_cache(uint64_t hash, uint32_t size, std::vector<uint8_t>& data) const {
+	if (cache_path.empty()) {
+		return false;
+	}
+	SDL_RWops* file = SDL_RWFromFile(cache_file(cache_path, hash).c_str(), "rb");
+	if (file == nullptr) {
+		return false;
+	}
+	data.resize(size);
+	bool complete = SDL_RWsize(file) == size && SDL_RWread(file, data.data(), 1, size) == size;
+	SDL_RWclose(file);
+	// A damaged file is requested again and overwritten
+	return complete && hash_content(data.data(), size) == hash;
+}
+
+void Client::write_cache(uint64_t hash, const uint8_t* data, uint32_t size) const {
+	if (cache_path.empty()) {
+		return;
+	}
+	SDL_RWops* file = SDL_RWFromFile(cache_file(cache_path, hash).c_str(), "wb");
+	if (file == nullptr) {
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not write content cache");
+		return;
+	}
+	SDL_RWwrite(file, data, 1, size);
+	SDL_RWclose(file);
+}
+
+void Client::read_partial(uint64_t hash, uint32_t size, std::vector<uint8_t>& data) const {
+	data.clear();
+	if (cache_path.empty()) {
+		return;
+	}
+	SDL_RWops* file = SDL_RWFromFile(partial_file(cache_path, hash).c_str(), "rb");
+	if (file == nullptr) {
+		return;
+	}
+	Sint64 length = SDL_RWsize(file);
+	if (length > 0 && length < size) {
+		data.resize(static_cast<size_t>(length));
+		if (SDL_RWread(file, data.data(), 1, data.size()) != data.size()) {
+			data.clear();
+		}
 	}
-	else if (packet->data[0] == static_cast<uint8_t>(ContentType::FONT)) {
-		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Received content update (font ID %u)", id);
-		renderer.load_font(id, packet->data + 9, length);
+	SDL_RWclose(file);
+	if (data.empty()) {
+		// The download starts over, so nothing may be appended to what is left
+		remove_partial(hash);
 	}
-	else if (packet->data[0] == static_cast<uint8_t>(ContentType::SOUND)) {
-		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Received content update (sound ID %u)", id);
-		audio.load_sound(id, packet->data + 9, length);
+}
+
+void Client::append_partial(uint64_t hash, const uint8_t* data, uint32_t size) const {
+	if (cache_path.empty()) {
+		return;
+	}
+	SDL_RWops* file = SDL_RWFromFile(partial_file(cache_path, hash).c_str(), "ab");
+	if (file == nullptr) {
+		return;
+	}
+	SDL_RWwrite(file, data, 1, size);
+	SDL_RWclose(file);
+}
+
+void Client::remove_partial(uint64_t hash) const {
+	if (!cache_path.empty()) {
+		std::remove(partial_file(cache_path, hash).c_str());
 	}
 }
+
+void Client::request_chunks(uint64_t hash, uint32_t offset) {
+	uint8_t request[16];
+	write32(request, 1);
+	write64(request + 4, hash);
+	write32(request + 12, offset);
+	enet_peer_send(peer, CONTENT_CHANNEL, enet_packet_create(request, sizeof(request),
+		ENET_PACKET_FLAG_RELIABLE));
+}
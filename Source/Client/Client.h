@@ -3,11 +3,17 @@
 #ifndef ANOMALY_CLIENT_CLIENT_H
 #define ANOMALY_CLIENT_CLIENT_H
 
+#include <array>
+#include <chrono>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <enet.h>
 
+#include <Anomaly.h>
 #include <Audio/Audio.h>
+#include <Network/Compressor.h>
 #include <Renderer/Renderer.h>
 #include <Renderer/Window.h>
 
@@ -19,17 +25,98 @@ public:
 
 	Client& operator=(const Client&) = delete;
 
-	bool connect(Window& window, const std::string& hostname, uint16_t port);
+	bool connect(Window& window, const std::string& hostname, uint16_t port, uint32_t room);
 	bool update(Audio& audio, Renderer& renderer);
+	void render(Renderer& renderer);
 
 private:
 	ENetHost* host = nullptr;
 	ENetPeer* peer = nullptr;
+	// Only decompresses, the few bytes of input are not worth compressing
+	Compressor compressor{ Compression::NONE };
 
-	void draw(Renderer& renderer, ENetPacket* packet);
+	struct Snapshot {
+		uint32_t number = 0;
+		// Simulation time of the server in seconds
+		double time = 0.0;
+		std::vector<Sprite> sprites;
+	};
+
+	struct Layer {
+		// The most recently received frames, later frames are sent as deltas against one of them
+		std::array<Snapshot, SPRITE_HISTORY> history;
+		uint32_t latest = 0;
+		std::vector<Sprite> decoded;
+		std::vector<std::string> strings;
+		// For every sprite of the later of two interpolated frames, the index of the same sprite
+		// in the earlier frame or UINT32_MAX
+		uint32_t matched_from = 0;
+		uint32_t matched_to = 0;
+		std::vector<uint32_t> matches;
+		std::vector<Sprite> interpolated;
+	};
+
+	// Created and changed by the server through the retained channel, the ID is 0 for handles
+	// that are not in use
+	struct RetainedSprite {
+		uint32_t id;
+		float x, y, scale;
+		bool visible;
+	};
+
+	// Indexed by handle - 1
+	std::vector<RetainedSprite> retained;
+
+	// The shared layer is the same for all players of a room and drawn below the player's own
+	Layer layer;
+	Layer shared_layer;
+
+	// The server's simulation time is mapped to local time by the offset of the fastest frame,
+	// and shown with a delay that covers the frame interval and the jitter of arrival times
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool clock_synced = false;
+	double clock_offset = 0.0;
+	double jitter = 0.0;
+	double frame_interval = MINIMUM_FRAME_TIME;
+	double last_frame_time = 0.0;
+	double playback_time = 0.0;
+	double last_render = 0.0;
+
+	// Blobs are received in chunks and cached on disk by hash, content waits for its blob here.
+	// Unfinished blobs are kept on disk as well, so that they can be resumed after a reconnect.
+	struct Download {
+		std::vector<ContentEntry> entries;
+		std::vector<uint8_t> data;
+		uint32_t size;
+	};
+
+	// The cache directory followed by the prefix of the server's files once connected
+	std::string cache_path;
+	std::unordered_map<uint64_t, Download> downloads;
+	// Bytes of all downloads since the last time nothing was missing, for the progress bar
+	uint64_t download_total = 0;
+	uint64_t download_received = 0;
+	// Hash of the newest version of all content the server has announced, by type << 32 | ID
+	std::unordered_map<uint64_t, uint64_t> content_hashes;
+
+	bool decode_sprites(Layer& layer, ENetPacket* packet);
+	void update_retained(ENetPacket* packet);
+	double local_time() const;
+	void sync_clock(double time);
+	const std::vector<Sprite>& interpolate(Layer& layer);
+	void match_sprites(Layer& layer, const Snapshot& from, const Snapshot& to);
+	static void draw_layer(Renderer& renderer, const std::vector<Sprite>& sprites);
 	void handle_commands(Renderer& renderer, ENetPacket* packet);
 	void handle_audio(Audio& audio, ENetPacket* packet);
-	void update_content(Audio& audio, Renderer& window, ENetPacket* packet);
+	void update_content(Audio& audio, Renderer& renderer, ENetPacket* packet);
+	void load_content(Audio& audio, Renderer& renderer, const ContentEntry& entry,
+		const uint8_t* data, bool cached);
+	bool read_cache(uint64_t hash, uint32_t size, std::vector<uint8_t>& data) const;
+	void write_cache(uint64_t hash, const uint8_t* data, uint32_t size) const;
+	void read_partial(uint64_t hash, uint32_t size, std::vector<uint8_t>& data) const;
+	void append_partial(uint64_t hash, const uint8_t* data, uint32_t size) const;
+	void remove_partial(uint64_t hash) const;
+	void request_chunks(uint64_t hash, uint32_t offset);
 };
 
 #endif
@@ -55,12 +55,23 @@ std::string start_menu(Renderer& renderer) {
 	}
 }
 
-void run_client(Audio& audio, Renderer& renderer, const std::string& hostname) {
+void run_client(Audio& audio, Renderer& renderer, std::string hostname) {
+	// 'hostname/room' joins a specific room, room 0 lets the server choose
+	uint32_t room = 0;
+	size_t separator = hostname.rfind('/');
+	if (separator != std::string::npos) {
+		try {
+			room = std::stoul(hostname.substr(separator + 1));
+		}
+		catch (...) {}
+		hostname = hostname.substr(0, separator);
+	}
 	auto last_update = std::chrono::high_resolution_clock::now();
 	Client client(renderer.get_window());
-	if (!client.connect(renderer.get_window(), hostname, 17899)) {
+	if (!client.connect(renderer.get_window(), hostname, 17899, room)) {
 		return;
 	}
+	auto last_render = last_update;
 	while (true) {
 		auto now = std::chrono::high_resolution_clock::now();
 		double duration = std::chrono::duration_cast<std::chrono::microseconds>(now -
@@ -70,10 +81,17 @@ void run_client(Audio& audio, Renderer& renderer, const std::string& hostname) {
 			if (!renderer.get_window().update()) throw std::exception();
 			if (!client.update(audio, renderer)) break;
 		}
+		// Frames are interpolated, so rendering runs at the display's rate instead of the server's
+		duration = std::chrono::duration_cast<std::chrono::microseconds>(now -
+			last_render).count() / 1000000.0;
+		if (duration >= MINIMUM_RENDER_TIME) {
+			last_render = now;
+			client.render(renderer);
+		}
 	}
 }
 
-int SDL_main(int argc, char* argv[]) {
+int main(int argc, char* argv[]) {
 	try {
 		Window window;
 		Audio audio(window);
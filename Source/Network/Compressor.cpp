@@ -0,0 +1,345 @@
+// Copyright 2023 Justus Zorn
+
+#include <algorithm>
+
+#include <Anomaly.h>
+#include <Network/Compressor.h>
+
+constexpr size_t LZ_MIN_MATCH = 4;
+
+// Appends the rest of a length that did not fit into its 4 bit field, in the LZ4 style
+static void write_length(uint8_t* output, size_t& out, size_t length) {
+	while (length >= 255) {
+		output[out++] = 255;
+		length -= 255;
+	}
+	output[out++] = static_cast<uint8_t>(length);
+}
+
+static bool read_length(const uint8_t* data, size_t length, size_t& in, size_t& result) {
+	uint8_t byte;
+	do {
+		if (in >= length) {
+			return false;
+		}
+		byte = data[in++];
+		result += byte;
+	} while (byte == 255);
+	return true;
+}
+
+// Writes a run of literals followed by a match, the last sequence only has literals
+static bool write_sequence(const uint8_t* literals, size_t literal_length, size_t offset,
+	size_t match_length, uint8_t* output, size_t& out, size_t output_limit) {
+	size_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+	size_t worst_case = 1 + literal_length / 255 + 1 + literal_length + 2 + match_code / 255 + 1;
+	if (out + worst_case > output_limit) {
+		return false;
+	}
+	output[out++] = static_cast<uint8_t>(std::min<size_t>(literal_length, 15) << 4 |
+		std::min<size_t>(match_code, 15));
+	if (literal_length >= 15) {
+		write_length(output, out, literal_length - 15);
+	}
+	memcpy(output + out, literals, literal_length);
+	out += literal_length;
+	if (match_length > 0) {
+		output[out++] = static_cast<uint8_t>(offset & 0xFF);
+		output[out++] = static_cast<uint8_t>(offset >> 8);
+		if (match_code >= 15) {
+			write_length(output, out, match_code - 15);
+		}
+	}
+	return true;
+}
+
+// Binary range coder with adaptive probabilities, as used by LZMA
+class RangeEncoder {
+public:
+	RangeEncoder(uint8_t* output, size_t output_limit) : output{ output }, output_limit{ output_limit } {}
+
+	void encode(uint16_t& probability, uint32_t bit) {
+		uint32_t bound = (range >> 11) * probability;
+		if (bit == 0) {
+			range = bound;
+			probability += (2048 - probability) >> 5;
+		}
+		else {
+			low += bound;
+			range -= bound;
+			probability -= probability >> 5;
+		}
+		while (range < (1u << 24)) {
+			range <<= 8;
+			shift_low();
+		}
+	}
+
+	size_t finish() {
+		for (int i = 0; i < 5; ++i) {
+			shift_low();
+		}
+		return overflow ? 0 : out;
+	}
+
+private:
+	uint8_t* output;
+	size_t output_limit;
+	size_t out = 0;
+	bool overflow = false;
+	uint64_t low = 0;
+	uint32_t range = 0xFFFFFFFF;
+	uint8_t cache = 0;
+	uint64_t cache_size = 1;
+
+	void shift_low() {
+		if (static_cast<uint32_t>(low) < 0xFF000000 || (low >> 32) != 0) {
+			uint8_t carry = static_cast<uint8_t>(low >> 32);
+			uint8_t byte = cache;
+			do {
+				put(static_cast<uint8_t>(byte + carry));
+				byte = 0xFF;
+			} while (--cache_size != 0);
+			cache = static_cast<uint8_t>(low >> 24);
+		}
+		++cache_size;
+		low = (low & 0x00FFFFFF) << 8;
+	}
+
+	void put(uint8_t byte) {
+		if (out < output_limit) {
+			output[out++] = byte;
+		}
+		else {
+			overflow = true;
+		}
+	}
+};
+
+class RangeDecoder {
+public:
+	RangeDecoder(const uint8_t* data, size_t length) : data{ data }, length{ length } {
+		for (int i = 0; i < 5; ++i) {
+			code = code << 8 | next();
+		}
+	}
+
+	uint32_t decode(uint16_t& probability) {
+		uint32_t bound = (range >> 11) * probability;
+		uint32_t bit;
+		if (code < bound) {
+			range = bound;
+			probability += (2048 - probability) >> 5;
+			bit = 0;
+		}
+		else {
+			code -= bound;
+			range -= bound;
+			probability -= probability >> 5;
+			bit = 1;
+		}
+		while (range < (1u << 24)) {
+			range <<= 8;
+			code = code << 8 | next();
+		}
+		return bit;
+	}
+
+private:
+	const uint8_t* data;
+	size_t length;
+	size_t in = 0;
+	uint32_t range = 0xFFFFFFFF;
+	uint32_t code = 0;
+
+	uint8_t next() {
+		return in < length ? data[in++] : 0;
+	}
+};
+
+Compressor::Compressor(Compression outgoing) : outgoing{ outgoing } {
+	input.reserve(ENET_PROTOCOL_MAXIMUM_MTU);
+}
+
+void Compressor::install(ENetHost* host) {
+	ENetCompressor compressor;
+	compressor.context = this;
+	compressor.compress = compress;
+	compressor.decompress = decompress;
+	compressor.destroy = nullptr;
+	enet_host_compress(host, &compressor);
+}
+
+uint64_t Compressor::get_raw_bytes() const {
+	return raw_bytes;
+}
+
+uint64_t Compressor::get_compressed_bytes() const {
+	return compressed_bytes;
+}
+
+size_t Compressor::compress_lz(uint8_t* output, size_t output_limit) {
+	const uint8_t* data = input.data();
+	size_t length = input.size();
+	positions.fill(0);
+	size_t out = 0;
+	size_t anchor = 0;
+	size_t i = 0;
+	while (i + LZ_MIN_MATCH <= length) {
+		uint32_t sequence;
+		memcpy(&sequence, data + i, sizeof(sequence));
+		size_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+		size_t candidate = positions[hash];
+		positions[hash] = static_cast<uint16_t>(i + 1);
+		if (candidate == 0 || memcmp(data + candidate - 1, data + i, LZ_MIN_MATCH) != 0) {
+			++i;
+			continue;
+		}
+		size_t match = candidate - 1;
+		size_t match_length = LZ_MIN_MATCH;
+		while (i + match_length < length && data[match + match_length] == data[i + match_length]) {
+			++match_length;
+		}
+		if (!write_sequence(data + anchor, i - anchor, i - match, match_length, output, out,
+			output_limit)) {
+			return 0;
+		}
+		i += match_length;
+		anchor = i;
+	}
+	if (!write_sequence(data + anchor, length - anchor, 0, 0, output, out, output_limit)) {
+		return 0;
+	}
+	return out;
+}
+
+size_t Compressor::decompress_lz(const uint8_t* data, size_t length, uint8_t* output,
+	size_t output_limit) {
+	size_t in = 0;
+	size_t out = 0;
+	while (in < length) {
+		uint8_t token = data[in++];
+		size_t literal_length = token >> 4;
+		if (literal_length == 15 && !read_length(data, length, in, literal_length)) {
+			return 0;
+		}
+		if (literal_length > length - in || literal_length > output_limit - out) {
+			return 0;
+		}
+		memcpy(output + out, data + in, literal_length);
+		in += literal_length;
+		out += literal_length;
+		if (in == length) {
+			break;
+		}
+		if (length - in < 2) {
+			return 0;
+		}
+		size_t offset = data[in] | data[in + 1] << 8;
+		in += 2;
+		size_t match_length = token & 15;
+		if (match_length == 15 && !read_length(data, length, in, match_length)) {
+			return 0;
+		}
+		match_length += LZ_MIN_MATCH;
+		if (offset == 0 || offset > out || match_length > output_limit - out) {
+			return 0;
+		}
+		// Matches may overlap with their own output, so copy byte by byte
+		for (size_t j = 0; j < match_length; ++j) {
+			output[out + j] = output[out - offset + j];
+		}
+		out += match_length;
+	}
+	return out;
+}
+
+size_t Compressor::compress_range(uint8_t* output, size_t output_limit) {
+	if (output_limit < 2) {
+		return 0;
+	}
+	write16(output, static_cast<uint16_t>(input.size()));
+	probabilities.fill(1024);
+	RangeEncoder encoder(output + 2, output_limit - 2);
+	uint8_t previous = 0;
+	for (uint8_t byte : input) {
+		// Order 1 context on the top bits of the previous byte, each byte is coded as a bit tree
+		uint16_t* model = probabilities.data() + (previous >> 5) * 256;
+		uint32_t node = 1;
+		for (int bit = 7; bit >= 0; --bit) {
+			uint32_t value = (byte >> bit) & 1;
+			encoder.encode(model[node], value);
+			node = node << 1 | value;
+		}
+		previous = byte;
+	}
+	size_t result = encoder.finish();
+	return result == 0 ? 0 : result + 2;
+}
+
+size_t Compressor::decompress_range(const uint8_t* data, size_t length, uint8_t* output,
+	size_t output_limit) {
+	if (length < 2) {
+		return 0;
+	}
+	size_t original_length = read16(const_cast<uint8_t*>(data));
+	if (original_length > output_limit) {
+		return 0;
+	}
+	probabilities.fill(1024);
+	RangeDecoder decoder(data + 2, length - 2);
+	uint8_t previous = 0;
+	for (size_t i = 0; i < original_length; ++i) {
+		uint16_t* model = probabilities.data() + (previous >> 5) * 256;
+		uint32_t node = 1;
+		while (node < 256) {
+			node = node << 1 | decoder.decode(model[node]);
+		}
+		output[i] = static_cast<uint8_t>(node);
+		previous = output[i];
+	}
+	return original_length;
+}
+
+size_t ENET_CALLBACK Compressor::compress(void* context, const ENetBuffer* buffers,
+	size_t buffer_count, size_t limit, enet_uint8* output, size_t output_limit) {
+	Compressor* compressor = static_cast<Compressor*>(context);
+	size_t result = 0;
+	if (compressor->outgoing != Compression::NONE && output_limit > 1) {
+		compressor->input.clear();
+		for (size_t i = 0; i < buffer_count; ++i) {
+			const uint8_t* data = static_cast<const uint8_t*>(buffers[i].data);
+			compressor->input.insert(compressor->input.end(), data, data + buffers[i].dataLength);
+		}
+		output[0] = static_cast<uint8_t>(compressor->outgoing);
+		if (compressor->outgoing == Compression::LZ) {
+			result = compressor->compress_lz(output + 1, output_limit - 1);
+		}
+		else {
+			result = compressor->compress_range(output + 1, output_limit - 1);
+		}
+		if (result > 0) {
+			++result;
+		}
+	}
+	// ENet only sends the compressed datagram if it is actually smaller
+	compressor->raw_bytes += limit;
+	compressor->compressed_bytes += result > 0 && result < limit ? result : limit;
+	return result;
+}
+
+size_t ENET_CALLBACK Compressor::decompress(void* context, const enet_uint8* data, size_t limit,
+	enet_uint8* output, size_t output_limit) {
+	Compressor* compressor = static_cast<Compressor*>(context);
+	if (limit < 1) {
+		return 0;
+	}
+	switch (static_cast<Compression>(data[0])) {
+	case Compression::LZ:
+		return compressor->decompress_lz(data + 1, limit - 1, output, output_limit);
+	case Compression::RANGE:
+		return compressor->decompress_range(data + 1, limit - 1, output, output_limit);
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,68 @@
+// Copyright 2023 Justus Zorn
+
+#ifndef ANOMALY_NETWORK_COMPRESSOR_H
+#define ANOMALY_NETWORK_COMPRESSOR_H
+
+#include <array>
+#include <atomic>
+#include <vector>
+
+#include <enet.h>
+
+enum class Compression {
+	NONE,
+	RANGE,
+	LZ
+};
+
+// The connect data carries the requested room in its lower bits, and the codecs the client can
+// decompress in its upper bits
+constexpr uint32_t CONNECT_ROOM_MASK = 0xFFFF;
+constexpr uint32_t CONNECT_CODEC_SHIFT = 16;
+
+constexpr uint32_t codec_bit(Compression compression) {
+	return 1u << static_cast<uint32_t>(compression);
+}
+
+constexpr uint32_t SUPPORTED_CODECS = codec_bit(Compression::RANGE) | codec_bit(Compression::LZ);
+
+constexpr size_t LZ_HASH_BITS = 12;
+constexpr uint32_t RANGE_CONTEXTS = 8;
+
+// Compresses whole datagrams on an ENet host. Every compressed datagram starts with the codec it
+// was compressed with, so both sides can always decompress each other, no matter which codec
+// they use for their own datagrams.
+class Compressor {
+public:
+	Compressor(Compression outgoing);
+	Compressor(const Compressor&) = delete;
+
+	Compressor& operator=(const Compressor&) = delete;
+
+	void install(ENetHost* host);
+
+	uint64_t get_raw_bytes() const;
+	uint64_t get_compressed_bytes() const;
+
+private:
+	Compression outgoing;
+	std::vector<uint8_t> input;
+	std::array<uint16_t, 1 << LZ_HASH_BITS> positions;
+	std::array<uint16_t, 256 * RANGE_CONTEXTS> probabilities;
+
+	// Only written by the thread servicing the host, but read for reports
+	std::atomic<uint64_t> raw_bytes = 0;
+	std::atomic<uint64_t> compressed_bytes = 0;
+
+	size_t compress_lz(uint8_t* output, size_t output_limit);
+	size_t decompress_lz(const uint8_t* data, size_t length, uint8_t* output, size_t output_limit);
+	size_t compress_range(uint8_t* output, size_t output_limit);
+	size_t decompress_range(const uint8_t* data, size_t length, uint8_t* output, size_t output_limit);
+
+	static size_t ENET_CALLBACK compress(void* context, const ENetBuffer* buffers,
+		size_t buffer_count, size_t limit, enet_uint8* output, size_t output_limit);
+	static size_t ENET_CALLBACK decompress(void* context, const enet_uint8* data, size_t limit,
+		enet_uint8* output, size_t output_limit);
+};
+
+#endif
@@ -1,17 +1,53 @@
 // Copyright 2023 Justus Zorn
 
+#include <algorithm>
+
 #include <Anomaly.h>
 #include <Renderer/Input.h>
 
+void Input::push_mouse_event(const MouseEvent& event) {
+	// Only the latest position of every pointer is kept, so that fast mice do not cause a flood
+	// of events
+	if (event.type == static_cast<uint8_t>(InputEventType::MOTION)) {
+		auto it = std::find_if(motion.begin(), motion.end(), [&event](const MouseEvent& e) {
+			return e.button == event.button;
+		});
+		if (it != motion.end()) {
+			*it = event;
+		}
+		else {
+			motion.push_back(event);
+		}
+		return;
+	}
+	if (!motion.empty()) {
+		// Motion before a press or release has to be handled before it. The first one of an
+		// update is stamped with the newest sample, so the pending motion becomes a sample of
+		// its own. Later ones would be stamped with that as well, so the motion before them goes
+		// with them in order.
+		if (mouse_events.empty()) {
+			close_sample();
+		}
+		else {
+			mouse_events.insert(mouse_events.end(), motion.begin(), motion.end());
+			motion.clear();
+		}
+	}
+	mouse_events.push_back(event);
+}
+
 ENetPacket* Input::create_input_packet() {
-	if (key_events.size() == 0 && mouse_events.size() == 0 && !changed_composition &&
-		wheel_x == 0.0f && wheel_y == 0.0f) {
+	if (key_events.size() == 0 && mouse_events.size() == 0 && !changed_composition) {
 		return nullptr;
 	}
 	changed_composition = false;
-	uint32_t length = 20 + 5 * key_events.size() + composition.length() + 10 * mouse_events.size();
+	uint32_t length = 16 + 5 * key_events.size() + composition.length() + 10 * mouse_events.size();
 	ENetPacket* packet = enet_packet_create(nullptr, length, ENET_PACKET_FLAG_RELIABLE);
 	uint8_t* data = packet->data;
+	// The newest motion sample, which has been sent before these events happened. The server
+	// handles motion up to it first, although motion takes another channel.
+	write32(data, sequence);
+	data += 4;
 	write32(data, static_cast<uint32_t>(key_events.size()));
 	data += 4;
 	for (const KeyEvent& e : key_events) {
@@ -32,11 +68,56 @@ ENetPacket* Input::create_input_packet() {
 		data[9] = e.type;
 		data += 10;
 	}
-	write_float(data, wheel_x);
-	write_float(data + 4, wheel_y);
 	key_events.clear();
 	mouse_events.clear();
+	return packet;
+}
+
+void Input::close_sample() {
+	MotionSample& sample = samples[++sequence % INPUT_REDUNDANCY];
+	sample.sequence = sequence;
+	std::swap(sample.pointers, motion);
+	motion.clear();
+	sample.wheel_x = wheel_x;
+	sample.wheel_y = wheel_y;
 	wheel_x = 0.0f;
 	wheel_y = 0.0f;
+	repeats = INPUT_REDUNDANCY;
+}
+
+ENetPacket* Input::create_motion_packet() {
+	if (!motion.empty() || wheel_x != 0.0f || wheel_y != 0.0f) {
+		close_sample();
+	}
+	if (repeats == 0) {
+		return nullptr;
+	}
+	--repeats;
+	// [first sequence][sample count], then every sample from oldest to newest as
+	// [wheel x][wheel y][pointer count] followed by [pointer][x][y] for every pointer
+	uint32_t count = std::min(sequence, INPUT_REDUNDANCY);
+	uint32_t first = sequence - count + 1;
+	uint32_t length = 5;
+	for (uint32_t i = first; i <= sequence; ++i) {
+		length += 9 + 9 * static_cast<uint32_t>(samples[i % INPUT_REDUNDANCY].pointers.size());
+	}
+	ENetPacket* packet = enet_packet_create(nullptr, length, 0);
+	uint8_t* data = packet->data;
+	write32(data, first);
+	data[4] = static_cast<uint8_t>(count);
+	data += 5;
+	for (uint32_t i = first; i <= sequence; ++i) {
+		const MotionSample& sample = samples[i % INPUT_REDUNDANCY];
+		write_float(data, sample.wheel_x);
+		write_float(data + 4, sample.wheel_y);
+		data[8] = static_cast<uint8_t>(sample.pointers.size());
+		data += 9;
+		for (const MouseEvent& e : sample.pointers) {
+			data[0] = e.button;
+			write_float(data + 1, e.x);
+			write_float(data + 5, e.y);
+			data += 9;
+		}
+	}
 	return packet;
 }
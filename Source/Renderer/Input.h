@@ -3,10 +3,14 @@
 #ifndef ANOMALY_RENDERER_INPUT_H
 #define ANOMALY_RENDERER_INPUT_H
 
+#include <array>
+#include <string>
 #include <vector>
 
 #include <enet.h>
 
+#include <Anomaly.h>
+
 struct KeyEvent {
 	int32_t key;
 	bool down;
@@ -18,16 +22,36 @@ struct MouseEvent {
 	uint8_t type;
 };
 
+// The latest position of every pointer that moved and the wheel movement of one update
+struct MotionSample {
+	uint32_t sequence = 0;
+	std::vector<MouseEvent> pointers;
+	float wheel_x = 0.0f;
+	float wheel_y = 0.0f;
+};
+
 struct Input {
+	// Discrete events, sent reliably
 	std::vector<KeyEvent> key_events;
 	std::string composition;
 	std::vector<MouseEvent> mouse_events;
+	// Continuous state, sent unreliably with the last few samples repeated
+	std::vector<MouseEvent> motion;
 	float wheel_x = 0.0f;
 	float wheel_y = 0.0f;
 
 	bool changed_composition = false;
 
+	void push_mouse_event(const MouseEvent& event);
 	ENetPacket* create_input_packet();
+	ENetPacket* create_motion_packet();
+
+private:
+	std::array<MotionSample, INPUT_REDUNDANCY> samples;
+	uint32_t sequence = 0;
+	uint32_t repeats = 0;
+
+	void close_sample();
 };
 
 #endif
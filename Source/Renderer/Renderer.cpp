@@ -53,6 +53,10 @@ uint8_t missing_texture_data[] = {
 	255, 0, 255
 };
 
+uint8_t white_texture_data[] = {
+	255, 255, 255, 255
+};
+
 Renderer::Renderer(Window& window)
 	: window{ &window }, sprite_shader(window, vsh, sprite_fsh), font_shader(window, vsh, font_fsh) {
 	sprite_shader_pos = sprite_shader.get_uniform_location("pos");
@@ -91,6 +95,14 @@ Renderer::Renderer(Window& window)
 
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 2, 2, 0, GL_RGB, GL_UNSIGNED_BYTE, missing_texture_data);
 
+	glGenTextures(1, &white_texture);
+	glBindTexture(GL_TEXTURE_2D, white_texture);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white_texture_data);
+
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
@@ -168,15 +180,14 @@ void Renderer::load_font(uint32_t id, const uint8_t* data, uint32_t length) {
 }
 
 void Renderer::draw_sprite(uint32_t id, float x, float y, float scale) {
-	if (id >= textures.size() || !textures[id].init) {
-		return;
-	}
+	// Images that have not arrived yet are drawn as a square placeholder
+	bool loaded = id < textures.size() && textures[id].init;
 
 	float window_aspect_ratio = window->aspect_ratio();
-	float texture_aspect_ratio = static_cast<float>(textures[id].width) / static_cast<float>(textures[id].height);
+	float texture_aspect_ratio = loaded ? static_cast<float>(textures[id].width) / static_cast<float>(textures[id].height) : 1.0f;
 
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, textures[id].texture);
+	glBindTexture(GL_TEXTURE_2D, loaded ? textures[id].texture : missing_texture);
 
 	float xscale = scale / window_aspect_ratio * texture_aspect_ratio;
 	x /= window_aspect_ratio;
@@ -193,6 +204,23 @@ void Renderer::draw_sprite(uint32_t id, float x, float y, float scale) {
 	glUseProgram(0);
 }
 
+void Renderer::draw_progress(float progress) {
+	// A thin bar along the bottom edge of the window
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, white_texture);
+
+	sprite_shader.use();
+	sprite_shader.set(sprite_shader_pos, -1.0f, -1.0f);
+	sprite_shader.set(sprite_shader_scale, 2.0f * progress, 0.02f);
+
+	glBindVertexArray(vao);
+	glDrawArrays(GL_TRIANGLES, 0, 6);
+	glBindVertexArray(0);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glUseProgram(0);
+}
+
 void Renderer::draw_text(uint32_t id, float x, float y, float scale, uint8_t r, uint8_t g,
 	uint8_t b, const uint8_t* text, uint32_t length) {
 	if (id >= fonts.size() || !fonts[id].init) {
@@ -29,6 +29,7 @@ public:
 	void load_font(uint32_t id, const uint8_t* data, uint32_t length);
 
 	void draw_sprite(uint32_t id, float x, float y, float scale);
+	void draw_progress(float progress);
 	void draw_text(uint32_t id, float x, float y, float scale, uint8_t r, uint8_t g, uint8_t b,
 		const uint8_t* text, uint32_t length);
 	void draw_string(uint32_t id, float x, float y, float scale, uint8_t r, uint8_t g, uint8_t b,
@@ -39,6 +40,7 @@ private:
 	
 	GLuint vao, vbo;
 	GLuint missing_texture;
+	GLuint white_texture;
 
 	Shader sprite_shader;
 	GLint sprite_shader_pos;
@@ -46,6 +46,10 @@ Window::Window() {
 	}
 #endif
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	// Rendering is paced by the display, adaptive vsync avoids stalling on a missed refresh
+	if (SDL_GL_SetSwapInterval(-1) < 0) {
+		SDL_GL_SetSwapInterval(1);
+	}
 }
 
 Window::~Window() {
@@ -92,35 +96,35 @@ bool Window::update() {
 			break;
 #ifdef ANOMALY_MOBILE
 		case SDL_FINGERDOWN:
-			input.mouse_events.push_back({ (event.tfinger.x * 2.0f - 1.0f) * aspect_ratio(),
+			input.push_mouse_event({ (event.tfinger.x * 2.0f - 1.0f) * aspect_ratio(),
 				-event.tfinger.y * 2.0f + 1.0f, static_cast<uint8_t>(event.tfinger.fingerId),
 				static_cast<uint8_t>(InputEventType::DOWN) });
 			break;
 		case SDL_FINGERUP:
-			input.mouse_events.push_back({ (event.tfinger.x * 2.0f - 1.0f) * aspect_ratio(),
+			input.push_mouse_event({ (event.tfinger.x * 2.0f - 1.0f) * aspect_ratio(),
 				-event.tfinger.y * 2.0f + 1.0f, static_cast<uint8_t>(event.tfinger.fingerId),
 				static_cast<uint8_t>(InputEventType::UP) });
 			break;
 		case SDL_FINGERMOTION:
-			input.mouse_events.push_back({ (event.tfinger.x * 2.0f - 1.0f) * aspect_ratio(),
+			input.push_mouse_event({ (event.tfinger.x * 2.0f - 1.0f) * aspect_ratio(),
 				-event.tfinger.y * 2.0f + 1.0f, static_cast<uint8_t>(event.tfinger.fingerId),
 				static_cast<uint8_t>(InputEventType::MOTION) });
 			break;
 #else
 		case SDL_MOUSEBUTTONDOWN:
-			input.mouse_events.push_back({ (event.button.x / width() * 2.0f - 1.0f) * aspect_ratio(),
+			input.push_mouse_event({ (event.button.x / width() * 2.0f - 1.0f) * aspect_ratio(),
 				-event.button.y / height() * 2.0f + 1.0f,
 				static_cast<uint8_t>(event.button.button),
 				static_cast<uint8_t>(InputEventType::DOWN) });
 			break;
 		case SDL_MOUSEBUTTONUP:
-			input.mouse_events.push_back({ (event.button.x / width() * 2.0f - 1.0f) * aspect_ratio(),
+			input.push_mouse_event({ (event.button.x / width() * 2.0f - 1.0f) * aspect_ratio(),
 				-event.button.y / height() * 2.0f + 1.0f,
 				static_cast<uint8_t>(event.button.button),
 				static_cast<uint8_t>(InputEventType::UP) });
 			break;
 		case SDL_MOUSEMOTION:
-			input.mouse_events.push_back({ (event.button.x / width() * 2.0f - 1.0f) * aspect_ratio(),
+			input.push_mouse_event({ (event.button.x / width() * 2.0f - 1.0f) * aspect_ratio(),
 				-event.button.y / height() * 2.0f + 1.0f, 0,
 				static_cast<uint8_t>(InputEventType::MOTION) });
 			break;
@@ -150,6 +154,10 @@ ENetPacket* Window::create_input_packet() {
 	return input.create_input_packet();
 }
 
+ENetPacket* Window::create_motion_packet() {
+	return input.create_motion_packet();
+}
+
 void Window::start_text_input() {
 	if (!SDL_IsTextInputActive()) {
 		SDL_StartTextInput();
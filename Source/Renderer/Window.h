@@ -25,6 +25,7 @@ public:
 	float aspect_ratio() const;
 
 	ENetPacket* create_input_packet();
+	ENetPacket* create_motion_packet();
 
 	void start_text_input();
 	void stop_text_input();
@@ -0,0 +1,242 @@
+// Copyright 2023 Justus Zorn
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include <enet.h>
+
+#include <Server/Config.h>
+
+static std::string trim(const std::string& str) {
+	size_t begin = str.find_first_not_of(" \t\r");
+	if (begin == std::string::npos) {
+		return "";
+	}
+	size_t end = str.find_last_not_of(" \t\r");
+	return str.substr(begin, end - begin + 1);
+}
+
+static bool parse_number(const std::string& value, double& result) {
+	try {
+		size_t length;
+		result = std::stod(value, &length);
+		return length == value.length();
+	}
+	catch (...) {
+		return false;
+	}
+}
+
+bool Config::load_file(const std::string& path) {
+	std::ifstream input(path);
+	if (!input.is_open()) {
+		std::cerr << "ERROR: Could not read config file '" << path << "'\n";
+		return false;
+	}
+	std::string line;
+	uint32_t line_number = 0;
+	bool result = true;
+	while (std::getline(input, line)) {
+		++line_number;
+		line = trim(line.substr(0, line.find('#')));
+		if (line.empty()) {
+			continue;
+		}
+		size_t separator = line.find('=');
+		if (separator == std::string::npos) {
+			std::cerr << "ERROR: Expected 'key = value' in '" << path << "', line " <<
+				line_number << '\n';
+			result = false;
+			continue;
+		}
+		if (!set(trim(line.substr(0, separator)), trim(line.substr(separator + 1)))) {
+			result = false;
+		}
+	}
+	return result;
+}
+
+bool Config::parse_arguments(int argc, char* argv[]) {
+	std::string config_file = "server.cfg";
+	bool explicit_config_file = false;
+	for (int i = 1; i + 1 < argc; ++i) {
+		if (std::string(argv[i]) == "--config") {
+			config_file = argv[i + 1];
+			explicit_config_file = true;
+		}
+	}
+	if (explicit_config_file || std::filesystem::exists(config_file)) {
+		if (!load_file(config_file)) {
+			return false;
+		}
+	}
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg.substr(0, 2) != "--" || i + 1 >= argc) {
+			std::cerr << "ERROR: Expected '--option value', got '" << arg << "'\n";
+			return false;
+		}
+		std::string key = arg.substr(2);
+		std::string value = argv[++i];
+		if (key == "config") {
+			continue;
+		}
+		for (char& c : key) {
+			if (c == '-') {
+				c = '_';
+			}
+		}
+		if (!set(key, value)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Config::set(const std::string& key, const std::string& value) {
+	double number;
+	if (key == "catch_up_policy") {
+		if (value == "drop") {
+			catch_up_policy = CatchUpPolicy::DROP;
+		}
+		else if (value == "merge") {
+			catch_up_policy = CatchUpPolicy::MERGE;
+		}
+		else {
+			std::cerr << "ERROR: Invalid catch_up_policy '" << value << "', must be 'drop' or 'merge'\n";
+			return false;
+		}
+		return true;
+	}
+	if (key == "hot_reload") {
+		if (value == "off") {
+			hot_reload = HotReload::OFF;
+		}
+		else if (value == "on") {
+			hot_reload = HotReload::ON;
+		}
+		else if (value == "modules") {
+			hot_reload = HotReload::MODULES;
+		}
+		else {
+			std::cerr << "ERROR: Invalid hot_reload '" << value << "', must be 'off', 'on' or 'modules'\n";
+			return false;
+		}
+		return true;
+	}
+	if (key == "compression") {
+		if (value == "none") {
+			compression = Compression::NONE;
+		}
+		else if (value == "range") {
+			compression = Compression::RANGE;
+		}
+		else if (value == "lz") {
+			compression = Compression::LZ;
+		}
+		else {
+			std::cerr << "ERROR: Invalid compression '" << value << "', must be 'none', 'range' or 'lz'\n";
+			return false;
+		}
+		return true;
+	}
+	if (key == "lua_profile") {
+		lua_profile = value;
+		return true;
+	}
+	if (!parse_number(value, number)) {
+		std::cerr << "ERROR: Invalid value '" << value << "' for option '" << key << "'\n";
+		return false;
+	}
+	if (key == "port") {
+		if (number < 0 || number > 65535) {
+			std::cerr << "ERROR: Invalid port " << value << '\n';
+			return false;
+		}
+		port = static_cast<uint16_t>(number);
+	}
+	else if (key == "rooms") {
+		if (number < 1 || number > 65535) {
+			std::cerr << "ERROR: rooms must be between 1 and 65535\n";
+			return false;
+		}
+		rooms = static_cast<uint16_t>(number);
+	}
+	else if (key == "max_clients") {
+		if (number < 1 || number > ENET_PROTOCOL_MAXIMUM_PEER_ID) {
+			std::cerr << "ERROR: max_clients must be between 1 and " <<
+				ENET_PROTOCOL_MAXIMUM_PEER_ID << '\n';
+			return false;
+		}
+		max_clients = static_cast<uint16_t>(number);
+	}
+	else if (key == "tick_rate") {
+		if (number <= 0.0) {
+			std::cerr << "ERROR: tick_rate must be positive\n";
+			return false;
+		}
+		tick_rate = number;
+	}
+	else if (key == "send_rate") {
+		if (number <= 0.0) {
+			std::cerr << "ERROR: send_rate must be positive\n";
+			return false;
+		}
+		send_rate = number;
+	}
+	else if (key == "max_catch_up_steps") {
+		if (number < 1) {
+			std::cerr << "ERROR: max_catch_up_steps must be at least 1\n";
+			return false;
+		}
+		max_catch_up_steps = static_cast<uint32_t>(number);
+	}
+	else if (key == "position_bits") {
+		if (number < 0 || number > 15) {
+			std::cerr << "ERROR: position_bits must be between 0 and 15\n";
+			return false;
+		}
+		position_bits = static_cast<uint8_t>(number);
+	}
+	else if (key == "content_rate") {
+		if (number <= 0.0) {
+			std::cerr << "ERROR: content_rate must be positive\n";
+			return false;
+		}
+		content_rate = number;
+	}
+	else if (key == "profile_interval") {
+		if (number < 0.0) {
+			std::cerr << "ERROR: profile_interval can not be negative\n";
+			return false;
+		}
+		profile_interval = number;
+	}
+	else if (key == "traffic_interval") {
+		if (number < 0.0) {
+			std::cerr << "ERROR: traffic_interval can not be negative\n";
+			return false;
+		}
+		traffic_interval = number;
+	}
+	else if (key == "lua_profile_interval") {
+		if (number < 1 || number > 1000000000) {
+			std::cerr << "ERROR: lua_profile_interval must be between 1 and 1000000000\n";
+			return false;
+		}
+		lua_profile_interval = static_cast<uint32_t>(number);
+	}
+	else if (key == "worker_threads") {
+		if (number < 0) {
+			std::cerr << "ERROR: worker_threads can not be negative\n";
+			return false;
+		}
+		worker_threads = static_cast<uint32_t>(number);
+	}
+	else {
+		std::cerr << "ERROR: Unknown option '" << key << "'\n";
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,52 @@
+// Copyright 2023 Justus Zorn
+
+#ifndef ANOMALY_SERVER_CONFIG_H
+#define ANOMALY_SERVER_CONFIG_H
+
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#include <Anomaly.h>
+#include <Network/Compressor.h>
+
+enum class CatchUpPolicy {
+	DROP,
+	MERGE
+};
+
+enum class HotReload {
+	OFF,
+	ON,
+	MODULES
+};
+
+struct Config {
+	uint16_t port = 17899;
+	uint16_t rooms = 1;
+	uint16_t max_clients = 32;
+	Compression compression = Compression::NONE;
+
+	double tick_rate = 1.0 / MINIMUM_FRAME_TIME;
+	double send_rate = 1.0 / MINIMUM_FRAME_TIME;
+	uint32_t max_catch_up_steps = 4;
+	CatchUpPolicy catch_up_policy = CatchUpPolicy::DROP;
+	uint8_t position_bits = 12;
+	double content_rate = 512.0;
+	HotReload hot_reload = HotReload::OFF;
+
+	double profile_interval = 0.0;
+	double traffic_interval = 60.0;
+	std::string lua_profile;
+	uint32_t lua_profile_interval = 1000;
+
+	uint32_t worker_threads = std::max(std::thread::hardware_concurrency(), 1u) - 1;
+
+	bool load_file(const std::string& path);
+	bool parse_arguments(int argc, char* argv[]);
+
+private:
+	bool set(const std::string& key, const std::string& value);
+};
+
+#endif
@@ -1,5 +1,6 @@
 // Copyright 2023 Justus Zorn
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 
@@ -19,126 +20,257 @@ static void read_file(const std::filesystem::path& path, std::vector<uint8_t>& d
 	input.read(reinterpret_cast<char*>(data.data()), length);
 }
 
+// The directories of the content types, in the order of ContentType
+static const char* content_directories[] = {
+	"Content/Images",
+	"Content/Fonts",
+	"Content/Sounds"
+};
+
+static_assert(sizeof(content_directories) / sizeof(content_directories[0]) == CONTENT_TYPES);
+
+static const char* scripts_directory = "Content/Scripts";
+
+static bool is_inside(const std::filesystem::path& path, const std::filesystem::path& directory) {
+	std::filesystem::path relative = path.lexically_relative(directory);
+	return !relative.empty() && *relative.begin() != "..";
+}
+
+bool ContentManager::watch(bool scripts) {
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	std::error_code error;
+	for (const char* directory : content_directories) {
+		std::filesystem::path root = std::filesystem::canonical(directory, error);
+		if (!error && !watcher.add(root)) {
+			return false;
+		}
+	}
+	if (scripts) {
+		std::filesystem::path root = std::filesystem::canonical(scripts_directory, error);
+		if (!error && !watcher.add(root)) {
+			return false;
+		}
+	}
+	return watcher.is_active();
+}
+
 void ContentManager::reload(Server& server) {
-	std::cout << "INFO: Reloading content...\n";
-	try {
-		for (auto entry : std::filesystem::recursive_directory_iterator("Content/Images")) {
-			if (entry.is_regular_file()) {
-				std::filesystem::path path = std::filesystem::canonical(entry.path());
-				Image* image;
-				auto it = images.find(path);
-				if (it != images.end()) {
-					image = &it->second;
-					if (entry.last_write_time() == image->last_write) {
-						continue;
-					}
-				}
-				else {
-					image = &images[path];
-					image->id = image_id++;
-				}
-				image->last_write = entry.last_write_time();
-				read_file(path, image->data);
-				int width, height;
-				stbi_info_from_memory(image->data.data(), image->data.size(), &width, &height,
-					nullptr);
-				image->aspect_ratio = static_cast<float>(width) / static_cast<float>(height);
-				server.update_content(ContentType::IMAGE, image->id, image->data);
-			}
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	std::vector<ContentEntry> changed;
+	collect_changes();
+	if (watcher.is_active() && scanned) {
+		if (dirty.empty()) {
+			return;
+		}
+		std::cout << "INFO: Reloading content (" << dirty.size() << " changes)...\n";
+		for (const std::filesystem::path& path : dirty) {
+			load_directory(path, changed);
 		}
+		dirty.clear();
 	}
-	catch (...) {}
-	try {
-		for (auto entry : std::filesystem::recursive_directory_iterator("Content/Fonts")) {
-			if (entry.is_regular_file()) {
-				std::filesystem::path path = std::filesystem::canonical(entry.path());
-				Font* font;
-				auto it = fonts.find(path);
-				if (it != fonts.end()) {
-					font = &it->second;
-					if (entry.last_write_time() == font->last_write) {
-						continue;
-					}
-				}
-				else {
-					font = &fonts[path];
-					font->id = font_id++;
-				}
-				font->last_write = entry.last_write_time();
-				read_file(path, font->data);
-				server.update_content(ContentType::FONT, font->id, font->data);
+	else {
+		std::cout << "INFO: Reloading content...\n";
+		for (const char* directory : content_directories) {
+			std::error_code error;
+			std::filesystem::path root = std::filesystem::canonical(directory, error);
+			if (!error) {
+				load_directory(root, changed);
 			}
 		}
+		dirty.clear();
+		scanned = true;
+	}
+	if (changed.empty()) {
+		return;
+	}
+	update_blobs();
+	for (const ContentEntry& entry : changed) {
+		update_entry(entry);
+	}
+	server.update_manifest(changed);
+}
+
+bool ContentManager::poll_changes(std::vector<std::string>& modules) {
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	collect_changes();
+	std::error_code error;
+	std::filesystem::path root = std::filesystem::canonical(scripts_directory, error);
+	for (const std::filesystem::path& path : dirty_scripts) {
+		if (path.extension() != ".lua") {
+			continue;
+		}
+		// Modules are named like require expects them, 'Content/Scripts/a/b.lua' is 'a.b'
+		std::string module = path.lexically_relative(root).replace_extension().generic_string();
+		std::replace(module.begin(), module.end(), '/', '.');
+		modules.push_back(module);
+	}
+	dirty_scripts.clear();
+	return !dirty.empty() || !scanned;
+}
+
+void ContentManager::collect_changes() {
+	if (!watcher.is_active()) {
+		return;
+	}
+	std::vector<std::filesystem::path> changed;
+	if (!watcher.poll(changed)) {
+		// Events were dropped, so only a full rescan can find everything that changed
+		std::cerr << "ERROR: Lost track of content changes, rescanning\n";
+		scanned = false;
+	}
+	std::error_code error;
+	std::filesystem::path scripts = std::filesystem::canonical(scripts_directory, error);
+	for (const std::filesystem::path& path : changed) {
+		if (!error && is_inside(path, scripts)) {
+			dirty_scripts.insert(path);
+		}
+		else {
+			dirty.insert(path);
+		}
 	}
-	catch (...) {}
-	try {
-		for (auto entry : std::filesystem::recursive_directory_iterator("Content/Sounds")) {
-			if (entry.is_regular_file()) {
-				std::filesystem::path path = std::filesystem::canonical(entry.path());
-				Sound* sound;
-				auto it = sounds.find(path);
-				if (it != sounds.end()) {
-					sound = &it->second;
-					if (entry.last_write_time() == sound->last_write) {
-						continue;
-					}
-				}
-				else {
-					sound = &sounds[path];
-					sound->id = sound_id++;
-				}
-				sound->last_write = entry.last_write_time();
-				read_file(path, sound->data);
-				server.update_content(ContentType::SOUND, sound->id, sound->data);
+}
+
+void ContentManager::load_directory(const std::filesystem::path& directory,
+	std::vector<ContentEntry>& changed) {
+	std::error_code error;
+	std::filesystem::path path = std::filesystem::canonical(directory, error);
+	if (error) {
+		// Deleted again before it was reloaded
+		return;
+	}
+	for (size_t type = 0; type < CONTENT_TYPES; ++type) {
+		std::filesystem::path root = std::filesystem::canonical(content_directories[type], error);
+		if (error || (path != root && !is_inside(path, root))) {
+			continue;
+		}
+		if (std::filesystem::is_regular_file(path, error)) {
+			load_asset(static_cast<ContentType>(type), root, path, changed);
+			return;
+		}
+		for (auto it = std::filesystem::recursive_directory_iterator(path, error);
+			it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+			if (it->is_regular_file(error)) {
+				load_asset(static_cast<ContentType>(type), root,
+					std::filesystem::canonical(it->path(), error), changed);
 			}
 		}
-	} catch (...) {}
+		return;
+	}
 }
 
-void ContentManager::init_client(Server& server, uint16_t client) {
-	for (auto it : images) {
-		server.update_client_content(client, ContentType::IMAGE, it.second.id, it.second.data);
+void ContentManager::load_asset(ContentType type, const std::filesystem::path& root,
+	const std::filesystem::path& path, std::vector<ContentEntry>& changed) {
+	std::error_code error;
+	std::filesystem::file_time_type last_write = std::filesystem::last_write_time(path, error);
+	if (error) {
+		return;
 	}
-	for (auto it : fonts) {
-		server.update_client_content(client, ContentType::FONT, it.second.id, it.second.data);
+	std::unordered_map<std::filesystem::path, Asset>& type_assets =
+		assets[static_cast<size_t>(type)];
+	Asset* asset;
+	auto it = type_assets.find(path);
+	if (it != type_assets.end()) {
+		asset = &it->second;
+		if (last_write == asset->last_write) {
+			return;
+		}
 	}
-	for (auto it : sounds) {
-		server.update_client_content(client, ContentType::SOUND, it.second.id, it.second.data);
+	else {
+		asset = &type_assets[path];
+		asset->id = next_id[static_cast<size_t>(type)]++;
+		// Map nodes never move, so the name can be referenced by the lookup table
+		asset->name = path.lexically_relative(root).generic_string();
+		names[static_cast<size_t>(type)][asset->name] = asset->id;
 	}
+	asset->last_write = last_write;
+	read_file(path, asset->data);
+	if (type == ContentType::IMAGE) {
+		int width, height;
+		stbi_info_from_memory(asset->data.data(), asset->data.size(), &width, &height, nullptr);
+		if (aspect_ratios.size() <= asset->id) {
+			aspect_ratios.resize(asset->id + 1);
+		}
+		aspect_ratios[asset->id] = static_cast<float>(width) / static_cast<float>(height);
+	}
+	asset->hash = hash_content(asset->data.data(), asset->data.size());
+	changed.push_back({ type, asset->id, asset->hash, static_cast<uint32_t>(asset->data.size()) });
 }
 
-uint32_t ContentManager::get_image_id(const std::string& path) const {
-	std::filesystem::path p = std::filesystem::weakly_canonical("Content/Images/" + path);
-	auto it = images.find(p);
-	if (it != images.end()) {
-		return it->second.id;
+void ContentManager::update_blobs() {
+	blobs.clear();
+	for (const auto& type_assets : assets) {
+		for (const auto& [path, asset] : type_assets) {
+			blobs[asset.hash] = &asset.data;
+		}
 	}
-	return 0;
 }
 
-uint32_t ContentManager::get_font_id(const std::string& path) const {
-	std::filesystem::path p = std::filesystem::weakly_canonical("Content/Fonts/" + path);
-	auto it = fonts.find(p);
-	if (it != fonts.end()) {
-		return it->second.id;
+void ContentManager::update_entry(const ContentEntry& entry) {
+	std::vector<ContentEntry>& type_entries = entries[static_cast<size_t>(entry.type)];
+	if (type_entries.size() <= entry.id) {
+		type_entries.resize(entry.id + 1);
 	}
-	return 0;
+	type_entries[entry.id] = entry;
 }
 
-uint32_t ContentManager::get_sound_id(const std::string& path) const {
-	std::filesystem::path p = std::filesystem::weakly_canonical("Content/Sounds/" + path);
-	auto it = sounds.find(p);
-	if (it != sounds.end()) {
-		return it->second.id;
+uint32_t ContentManager::get_id(ContentType type, std::string_view path) const {
+	std::shared_lock<std::shared_mutex> lock(mutex);
+	const auto& type_names = names[static_cast<size_t>(type)];
+	auto it = type_names.find(path);
+	if (it != type_names.end()) {
+		return it->second;
+	}
+	lock.unlock();
+	// Paths like 'a/../b.png' or symbolic links only have to be resolved if the name is unknown
+	std::filesystem::path resolved = std::filesystem::weakly_canonical(
+		std::string(content_directories[static_cast<size_t>(type)]) + '/' + std::string(path));
+	lock.lock();
+	const auto& type_assets = assets[static_cast<size_t>(type)];
+	auto asset = type_assets.find(resolved);
+	if (asset != type_assets.end()) {
+		return asset->second.id;
 	}
 	return 0;
 }
 
-float ContentManager::get_image_aspect_ratio(const std::string& path) const {
-	std::filesystem::path p = std::filesystem::weakly_canonical("Content/Images/" + path);
-	auto it = images.find(p);
-	if (it != images.end()) {
-		return it->second.aspect_ratio;
+bool ContentManager::has_id(ContentType type, uint32_t id) const {
+	std::shared_lock<std::shared_mutex> lock(mutex);
+	return id != 0 && id < next_id[static_cast<size_t>(type)];
+}
+
+float ContentManager::get_image_aspect_ratio(uint32_t id) const {
+	std::shared_lock<std::shared_mutex> lock(mutex);
+	if (id < aspect_ratios.size()) {
+		return aspect_ratios[id];
 	}
 	return 0.0f;
 }
+
+bool ContentManager::get_entry(ContentType type, uint32_t id, ContentEntry& entry) const {
+	std::shared_lock<std::shared_mutex> lock(mutex);
+	const std::vector<ContentEntry>& type_entries = entries[static_cast<size_t>(type)];
+	if (id == 0 || id >= type_entries.size()) {
+		return false;
+	}
+	entry = type_entries[id];
+	return true;
+}
+
+bool ContentManager::has_blob(uint64_t hash) const {
+	std::shared_lock<std::shared_mutex> lock(mutex);
+	return blobs.find(hash) != blobs.end();
+}
+
+bool ContentManager::read_chunk(uint64_t hash, uint32_t offset, std::vector<uint8_t>& chunk,
+	uint32_t& size) const {
+	std::shared_lock<std::shared_mutex> lock(mutex);
+	// Blobs replaced by a reload in the meantime are announced again with the new hash
+	auto it = blobs.find(hash);
+	if (it == blobs.end() || offset >= it->second->size()) {
+		return false;
+	}
+	const std::vector<uint8_t>& data = *it->second;
+	size = static_cast<uint32_t>(data.size());
+	chunk.assign(data.begin() + offset, data.begin() + std::min(size, offset + CONTENT_CHUNK_SIZE));
+	return true;
+}
@@ -3,52 +3,70 @@
 #ifndef ANOMALY_SERVER_CONTENT_MANAGER_H
 #define ANOMALY_SERVER_CONTENT_MANAGER_H
 
+#include <array>
 #include <filesystem>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <Server/ContentWatcher.h>
 #include <Server/Server.h>
 
 class ContentManager {
 public:
+	bool watch(bool scripts);
 	void reload(Server& server);
-	void init_client(Server& server, uint16_t client);
+	bool poll_changes(std::vector<std::string>& modules);
 
-	uint32_t get_image_id(const std::string& path) const;
-	uint32_t get_font_id(const std::string& path) const;
-	uint32_t get_sound_id(const std::string& path) const;
+	uint32_t get_id(ContentType type, std::string_view path) const;
+	bool has_id(ContentType type, uint32_t id) const;
+	float get_image_aspect_ratio(uint32_t id) const;
 
-	float get_image_aspect_ratio(const std::string& path) const;
+	bool get_entry(ContentType type, uint32_t id, ContentEntry& entry) const;
+	bool has_blob(uint64_t hash) const;
+	bool read_chunk(uint64_t hash, uint32_t offset, std::vector<uint8_t>& chunk,
+		uint32_t& size) const;
 
 private:
-	struct Image {
-		std::vector<uint8_t> data;
-		std::filesystem::file_time_type last_write;
-		uint32_t id;
-		float aspect_ratio;
-	};
+	// Rooms look up content concurrently, and any of them may trigger a reload
+	mutable std::shared_mutex mutex;
 
-	struct Font {
+	struct Asset {
 		std::vector<uint8_t> data;
 		std::filesystem::file_time_type last_write;
+		// The path relative to the directory of its type, as scripts name it
+		std::string name;
 		uint32_t id;
+		uint64_t hash;
 	};
 
-	struct Sound {
-		std::vector<uint8_t> data;
-		std::filesystem::file_time_type last_write;
-		uint32_t id;
-	};
+	std::array<uint32_t, CONTENT_TYPES> next_id = { 1, 1, 1 };
+	std::array<std::unordered_map<std::filesystem::path, Asset>, CONTENT_TYPES> assets;
+	// IDs by the names of the assets, so that looking up content does not touch the filesystem
+	std::array<std::unordered_map<std::string_view, uint32_t>, CONTENT_TYPES> names;
+	std::vector<float> aspect_ratios;
+
+	// Manifest entries by type and ID, so that content can be announced when it is first used
+	std::array<std::vector<ContentEntry>, CONTENT_TYPES> entries;
 
-	uint32_t image_id = 1;
-	std::unordered_map<std::filesystem::path, Image> images;
+	// Identical files share one blob, the data belongs to any of them
+	std::unordered_map<uint64_t, const std::vector<uint8_t>*> blobs;
 
-	uint32_t font_id = 1;
-	std::unordered_map<std::filesystem::path, Font> fonts;
+	// Once everything has been scanned, only files reported by the watcher are reloaded
+	ContentWatcher watcher;
+	bool scanned = false;
+	std::unordered_set<std::filesystem::path> dirty;
+	std::unordered_set<std::filesystem::path> dirty_scripts;
 
-	uint32_t sound_id = 1;
-	std::unordered_map<std::filesystem::path, Sound> sounds;
+	void collect_changes();
+	void load_directory(const std::filesystem::path& directory, std::vector<ContentEntry>& changed);
+	void load_asset(ContentType type, const std::filesystem::path& root,
+		const std::filesystem::path& path, std::vector<ContentEntry>& changed);
+	void update_blobs();
+	void update_entry(const ContentEntry& entry);
 };
 
 #endif
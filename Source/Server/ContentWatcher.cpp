@@ -0,0 +1,97 @@
+// Copyright 2023 Justus Zorn
+
+#include <iostream>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <Server/ContentWatcher.h>
+
+ContentWatcher::~ContentWatcher() {
+#ifdef __linux__
+	if (fd >= 0) {
+		close(fd);
+	}
+#endif
+}
+
+bool ContentWatcher::add(const std::filesystem::path& root) {
+#ifdef __linux__
+	if (fd < 0) {
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd < 0) {
+			std::cerr << "ERROR: Could not watch content for changes\n";
+			return false;
+		}
+	}
+	add_directory(root);
+	std::error_code error;
+	for (auto it = std::filesystem::recursive_directory_iterator(root, error);
+		it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+		if (it->is_directory(error)) {
+			add_directory(it->path());
+		}
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool ContentWatcher::is_active() const {
+	return fd >= 0;
+}
+
+bool ContentWatcher::poll(std::vector<std::filesystem::path>& changed) {
+	bool complete = true;
+#ifdef __linux__
+	alignas(inotify_event) char buffer[4096];
+	while (true) {
+		ssize_t length = read(fd, buffer, sizeof(buffer));
+		if (length <= 0) {
+			break;
+		}
+		for (char* data = buffer; data < buffer + length;) {
+			inotify_event* event = reinterpret_cast<inotify_event*>(data);
+			data += sizeof(inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW) {
+				complete = false;
+				continue;
+			}
+			if (event->mask & IN_IGNORED) {
+				watches.erase(event->wd);
+				continue;
+			}
+			auto it = watches.find(event->wd);
+			if (it == watches.end() || event->len == 0) {
+				continue;
+			}
+			std::filesystem::path path = it->second / event->name;
+			if (event->mask & IN_ISDIR) {
+				// Files might have been created before the new directory was watched, so it is
+				// reported as a whole
+				if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+					add(path);
+					changed.push_back(path);
+				}
+			}
+			else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB)) {
+				changed.push_back(path);
+			}
+		}
+	}
+#endif
+	return complete;
+}
+
+void ContentWatcher::add_directory(const std::filesystem::path& directory) {
+#ifdef __linux__
+	int watch = inotify_add_watch(fd, directory.c_str(),
+		IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB | IN_CREATE);
+	if (watch >= 0) {
+		watches[watch] = directory;
+	}
+#endif
+}
@@ -0,0 +1,35 @@
+// Copyright 2023 Justus Zorn
+
+#ifndef ANOMALY_SERVER_CONTENT_WATCHER_H
+#define ANOMALY_SERVER_CONTENT_WATCHER_H
+
+#include <filesystem>
+#include <unordered_map>
+#include <vector>
+
+// Watches directory trees for changed files, so that a reload only has to look at those. Only
+// supported on Linux (inotify), elsewhere add always fails, is_active stays false and content is
+// rescanned instead.
+class ContentWatcher {
+public:
+	ContentWatcher() = default;
+	ContentWatcher(const ContentWatcher&) = delete;
+	~ContentWatcher();
+
+	ContentWatcher& operator=(const ContentWatcher&) = delete;
+
+	bool add(const std::filesystem::path& root);
+	bool is_active() const;
+
+	// Appends the files (and new directories) that changed since the last call. Returns false if
+	// changes were lost, the caller has to rescan everything then.
+	bool poll(std::vector<std::filesystem::path>& changed);
+
+private:
+	int fd = -1;
+	std::unordered_map<int, std::filesystem::path> watches;
+
+	void add_directory(const std::filesystem::path& directory);
+};
+
+#endif
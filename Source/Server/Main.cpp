@@ -1,35 +1,98 @@
 // Copyright 2023 Justus Zorn
 
 #include <chrono>
+#include <csignal>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
 
+#include <Server/Config.h>
 #include <Server/ContentManager.h>
-#include <Server/Script.h>
-#include <Server/Server.h>
+#include <Server/Network.h>
+#include <Server/Room.h>
+#include <Server/ThreadPool.h>
+
+static volatile std::sig_atomic_t profile_requested = 0;
+
+static void request_profile(int) {
+	profile_requested = 1;
+}
 
 int main(int argc, char* argv[]) {
+	Config config;
+	if (!config.parse_arguments(argc, argv)) {
+		return 1;
+	}
+
 	if (enet_initialize() < 0) {
 		std::cerr << "ERROR: Could not initialize ENet\n";
 		return 1;
 	}
 
+	Network network(config);
 	ContentManager content;
-	Server server(content, 17899);
-	content.reload(server);
-	Script script(server);
+	ThreadPool pool(config.worker_threads);
+
+	std::vector<std::unique_ptr<Room>> rooms;
+	for (uint16_t i = 0; i < config.rooms; ++i) {
+		rooms.push_back(std::make_unique<Room>(i, config, content, network, pool));
+	}
+	bool hot_reload = config.hot_reload != HotReload::OFF;
+	// Watching is useful without hot reload too, a reload only has to look at what changed
+	if (!content.watch(hot_reload) && hot_reload) {
+		std::cerr << "ERROR: Hot reload is not supported on this platform\n";
+		hot_reload = false;
+	}
+	content.reload(rooms[0]->get_server());
+	for (auto& room : rooms) {
+		room->start();
+	}
 
-	auto last_update = std::chrono::high_resolution_clock::now();
+#ifdef SIGUSR1
+	std::signal(SIGUSR1, request_profile);
+#endif
+	// The rooms run on their own threads, the main thread only reports profiles
+	using Clock = std::chrono::steady_clock;
+	auto after = [](double seconds) {
+		return Clock::now() + std::chrono::duration_cast<Clock::duration>(
+			std::chrono::duration<double>(seconds));
+	};
+	auto next_profile = after(config.profile_interval);
+	auto next_traffic = after(config.traffic_interval);
 	while (true) {
-		auto now = std::chrono::high_resolution_clock::now();
-		double duration = std::chrono::duration_cast<std::chrono::microseconds>(now -
-			last_update).count() / 1000000.0;
-		if (duration >= MINIMUM_FRAME_TIME) {
-			last_update = now;
-			server.update(script, duration);
-			if (script.check_reload()) {
-				content.reload(server);
+		std::this_thread::sleep_for(std::chrono::milliseconds(PROFILE_POLL_INTERVAL));
+		if (hot_reload) {
+			std::vector<std::string> modules;
+			if (content.poll_changes(modules)) {
+				// Content is reloaded through the first room, so the time shows up in its profile
+				ProfileScope scope(rooms[0]->get_server().get_profiler(), Phase::RELOAD);
+				content.reload(rooms[0]->get_server());
+			}
+			if (!modules.empty()) {
+				for (auto& room : rooms) {
+					room->reload_scripts(modules);
+				}
 			}
 		}
+		bool periodic = config.profile_interval > 0.0 && Clock::now() >= next_profile;
+		if (periodic || profile_requested) {
+			profile_requested = 0;
+			network.get_profiler().report(std::cout);
+			network.report_traffic(std::cout);
+			for (auto& room : rooms) {
+				room->get_server().get_profiler().report(std::cout);
+			}
+			std::cout.flush();
+			next_profile = after(config.profile_interval);
+			next_traffic = after(config.traffic_interval);
+		}
+		else if (config.traffic_interval > 0.0 && Clock::now() >= next_traffic) {
+			// The traffic is worth watching in production, where nobody profiles
+			network.report_traffic(std::cout);
+			std::cout.flush();
+			next_traffic = after(config.traffic_interval);
+		}
 	}
 
 	enet_deinitialize();
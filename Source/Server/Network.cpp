@@ -0,0 +1,424 @@
+// Copyright 2023 Justus Zorn
+
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <iostream>
+
+#include <Anomaly.h>
+#include <Server/Network.h>
+
+struct ChannelName {
+	uint16_t channel;
+	const char* name;
+};
+
+// Indexed by channel, a channel without a name fails the static_assert below
+static constexpr std::array<ChannelName, NET_CHANNELS> channel_names = { {
+	{ INPUT_CHANNEL, "input" },
+	{ COMMAND_CHANNEL, "command" },
+	{ SPRITE_CHANNEL, "sprite" },
+	{ CONTENT_CHANNEL, "content" },
+	{ AUDIO_CHANNEL, "audio" },
+	{ ACK_CHANNEL, "ack" },
+	{ SHARED_CHANNEL, "shared" },
+	{ RETAINED_CHANNEL, "retained" },
+	{ MOTION_CHANNEL, "motion" }
+} };
+
+static constexpr bool channel_names_complete() {
+	for (uint16_t i = 0; i < NET_CHANNELS; ++i) {
+		if (channel_names[i].channel != i || channel_names[i].name == nullptr) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static_assert(channel_names_complete(), "Every channel needs a name, in the order of the channels");
+
+static const char* compression_names[] = {
+	"none",
+	"range",
+	"lz"
+};
+
+static void release_content(void* data) {
+	// Called by ENet once a chunk has been acknowledged, or dropped with its peer
+	ENetPacket* packet = static_cast<ENetPacket*>(data);
+	static_cast<std::atomic<uint64_t>*>(packet->userData)->fetch_sub(packet->dataLength);
+}
+
+Network::Network(const Config& config) : compression{ config.compression },
+	compressor(config.compression), profiler("network") {
+	peers.resize(config.max_clients, nullptr);
+	peer_rooms.resize(config.max_clients, 0);
+	peer_generations.resize(config.max_clients, 0);
+	peer_stats.resize(config.max_clients);
+	published_stats.resize(config.max_clients);
+	content_in_flight = std::vector<std::atomic<uint64_t>>(config.max_clients);
+	for (uint16_t i = 0; i < config.rooms; ++i) {
+		inboxes.push_back(std::make_unique<Inbox>());
+	}
+
+	ENetAddress address = { 0 };
+	address.host = ENET_HOST_ANY;
+	address.port = config.port;
+
+	host = enet_host_create(&address, config.max_clients, NET_CHANNELS, 0, 0);
+	if (host == nullptr) {
+		std::cerr << "ERROR: Could not connect to network\n";
+		return;
+	}
+	// Incoming datagrams are decompressed even if outgoing ones are not compressed
+	compressor.install(host);
+
+	wake_socket = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+	if (wake_socket != ENET_SOCKET_NULL) {
+		wake_address = { 0 };
+		wake_address.host = in6addr_loopback;
+		if (enet_socket_bind(wake_socket, &wake_address) < 0 ||
+			enet_socket_get_address(wake_socket, &wake_address) < 0 ||
+			enet_socket_set_option(wake_socket, ENET_SOCKOPT_NONBLOCK, 1) < 0) {
+			std::cerr << "ERROR: Could not create wake up socket, polling the network instead\n";
+			enet_socket_destroy(wake_socket);
+			wake_socket = ENET_SOCKET_NULL;
+		}
+	}
+
+	thread = std::thread(&Network::run, this);
+}
+
+Network::~Network() {
+	running = false;
+	if (thread.joinable()) {
+		thread.join();
+	}
+	for (auto& inbox : inboxes) {
+		NetworkEvent event;
+		while (inbox->events.pop(event)) {
+			if (event.packet != nullptr) {
+				enet_packet_destroy(event.packet);
+			}
+		}
+	}
+	Message message;
+	while (messages.pop(message)) {
+		if (message.packet != nullptr) {
+			enet_packet_destroy(message.packet);
+		}
+	}
+	if (host != nullptr) {
+		enet_host_destroy(host);
+	}
+	if (wake_socket != ENET_SOCKET_NULL) {
+		enet_socket_destroy(wake_socket);
+	}
+}
+
+bool Network::poll(uint16_t room, NetworkEvent& event) {
+	return inboxes[room]->events.pop(event);
+}
+
+void Network::wait(uint16_t room, uint32_t timeout) {
+	Inbox& inbox = *inboxes[room];
+	std::unique_lock<std::mutex> lock(inbox.wake_mutex);
+	inbox.wake.wait_for(lock, std::chrono::milliseconds(timeout),
+		[&inbox] { return inbox.pending_events; });
+	inbox.pending_events = false;
+}
+
+void Network::send(uint16_t client, uint32_t generation, uint8_t channel, ENetPacket* packet) {
+	messages.push({ Message::Type::SEND, client, generation, channel, packet });
+	wake();
+}
+
+void Network::broadcast(uint8_t channel, ENetPacket* packet) {
+	messages.push({ Message::Type::BROADCAST, 0, 0, channel, packet });
+	wake();
+}
+
+void Network::broadcast(uint16_t room, uint8_t channel, ENetPacket* packet) {
+	messages.push({ Message::Type::BROADCAST_ROOM, room, 0, channel, packet });
+	wake();
+}
+
+void Network::disconnect(uint16_t client, uint32_t generation) {
+	messages.push({ Message::Type::DISCONNECT, client, generation, 0, nullptr });
+	wake();
+}
+
+bool Network::get_stats(uint16_t client, uint32_t generation, ClientStats& stats) {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	if (client >= published_stats.size() || !published_stats[client].connected ||
+		published_stats[client].generation != generation) {
+		return false;
+	}
+	stats = published_stats[client];
+	return true;
+}
+
+uint64_t Network::get_content_in_flight(uint16_t client) const {
+	return client < content_in_flight.size() ? content_in_flight[client].load() : 0;
+}
+
+const char* Network::get_channel_name(uint8_t channel) {
+	return channel < NET_CHANNELS ? channel_names[channel].name : "unknown";
+}
+
+Profiler& Network::get_profiler() {
+	return profiler;
+}
+
+void Network::report_traffic(std::ostream& output) {
+	uint64_t raw = compressor.get_raw_bytes();
+	uint64_t compressed = compressor.get_compressed_bytes();
+	output << "INFO: Traffic of network (compression: " <<
+		compression_names[static_cast<size_t>(compression)] << ", datagrams: " << raw <<
+		" bytes, sent: " << compressed << " bytes";
+	if (raw > 0) {
+		output << ", ratio: " << std::fixed << std::setprecision(3) <<
+			static_cast<double>(compressed) / raw << std::defaultfloat;
+	}
+	output << ")\n";
+	output << "      " << std::left << std::setw(16) << "channel" << std::right << std::setw(14) <<
+		"bytes" << '\n';
+	for (size_t i = 0; i < channel_bytes.size(); ++i) {
+		output << "      " << std::left << std::setw(16) << channel_names[i].name << std::right <<
+			std::setw(14) << channel_bytes[i].load() << '\n';
+	}
+	size_t clients = 0;
+	uint64_t ping_sum = 0, queued = 0;
+	uint32_t ping_max = 0;
+	double loss_sum = 0.0;
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		for (const ClientStats& stats : published_stats) {
+			if (stats.connected) {
+				++clients;
+				ping_sum += stats.ping;
+				ping_max = std::max(ping_max, stats.ping);
+				loss_sum += stats.packet_loss;
+				queued += stats.queued;
+			}
+		}
+	}
+	if (clients > 0) {
+		output << "      clients: " << clients << ", ping: " << ping_sum / clients << " ms mean, " <<
+			ping_max << " ms max, loss: " << std::fixed << std::setprecision(1) <<
+			100.0 * loss_sum / clients << std::defaultfloat << "% mean, queued: " << queued <<
+			" bytes\n";
+	}
+}
+
+void Network::run() {
+	while (running) {
+		// Cleared before the queue is emptied, so that any later message wakes the thread again
+		wake_pending = false;
+		Message message;
+		if (messages.pop(message)) {
+			ProfileScope scope(profiler, Phase::NETWORK_SEND);
+			do {
+				handle_message(message);
+			} while (messages.pop(message));
+		}
+		ENetEvent event;
+		int result = enet_host_service(host, &event, 0);
+		if (static_cast<int32_t>(enet_time_get() - next_stats) >= 0) {
+			publish_stats();
+			next_stats = enet_time_get() + NET_STATS_INTERVAL;
+		}
+		if (result <= 0) {
+			wait_for_traffic();
+			continue;
+		}
+		auto start = std::chrono::steady_clock::now();
+		while (result > 0) {
+			uint16_t peer_id = event.peer->incomingPeerID;
+			switch (event.type) {
+			case ENET_EVENT_TYPE_CONNECT:
+				if (compression != Compression::NONE &&
+					!((event.data >> CONNECT_CODEC_SHIFT) & codec_bit(compression))) {
+					std::cerr << "ERROR: Client can not decompress '" <<
+						compression_names[static_cast<size_t>(compression)] << "', disconnecting\n";
+					enet_peer_disconnect(event.peer, 0);
+					break;
+				}
+				peers[peer_id] = event.peer;
+				++peer_generations[peer_id];
+				peer_stats[peer_id] = ClientStats();
+				peer_stats[peer_id].connected = true;
+				peer_stats[peer_id].generation = peer_generations[peer_id];
+				peer_rooms[peer_id] = assign_room(event.data & CONNECT_ROOM_MASK);
+				++inboxes[peer_rooms[peer_id]]->clients;
+				push_event({ NetworkEvent::Type::CONNECT, peer_id, peer_generations[peer_id], 0,
+					nullptr });
+				break;
+			case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
+			case ENET_EVENT_TYPE_DISCONNECT:
+				if (peers[peer_id] != nullptr) {
+					peers[peer_id] = nullptr;
+					peer_stats[peer_id].connected = false;
+					--inboxes[peer_rooms[peer_id]]->clients;
+					push_event({ NetworkEvent::Type::DISCONNECT, peer_id,
+						peer_generations[peer_id], 0, nullptr });
+				}
+				break;
+			case ENET_EVENT_TYPE_RECEIVE:
+				if (event.channelID < NET_CHANNELS) {
+					peer_stats[peer_id].received[event.channelID] += event.packet->dataLength;
+				}
+				push_event({ NetworkEvent::Type::RECEIVE, peer_id, peer_generations[peer_id],
+					event.channelID, event.packet });
+				break;
+			}
+			result = enet_host_service(host, &event, 0);
+		}
+		std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+		profiler.record(Phase::NETWORK_SERVICE, duration.count());
+		for (auto& inbox : inboxes) {
+			if (inbox->received) {
+				inbox->received = false;
+				{
+					std::lock_guard<std::mutex> lock(inbox->wake_mutex);
+					inbox->pending_events = true;
+				}
+				inbox->wake.notify_one();
+			}
+		}
+	}
+}
+
+void Network::wake() {
+	if (wake_socket != ENET_SOCKET_NULL && !wake_pending.exchange(true)) {
+		uint8_t data = 0;
+		ENetBuffer buffer;
+		buffer.data = &data;
+		buffer.dataLength = sizeof(data);
+		enet_socket_send(wake_socket, &wake_address, &buffer, 1);
+	}
+}
+
+void Network::wait_for_traffic() {
+	if (wake_socket == ENET_SOCKET_NULL) {
+		uint32_t condition = ENET_SOCKET_WAIT_RECEIVE;
+		enet_socket_wait(host->socket, &condition,
+			host->connectedPeers > 0 ? NETWORK_POLL_TIMEOUT : IDLE_SERVICE_TIMEOUT);
+		return;
+	}
+	ENetSocketSet set;
+	ENET_SOCKETSET_EMPTY(set);
+	ENET_SOCKETSET_ADD(set, host->socket);
+	ENET_SOCKETSET_ADD(set, wake_socket);
+	uint32_t timeout = host->connectedPeers > 0 ? NETWORK_SERVICE_TIMEOUT : IDLE_SERVICE_TIMEOUT;
+	if (enet_socketset_select(std::max(host->socket, wake_socket), &set, nullptr, timeout) > 0 &&
+		ENET_SOCKETSET_CHECK(set, wake_socket)) {
+		uint8_t data[16];
+		ENetBuffer buffer;
+		buffer.data = data;
+		buffer.dataLength = sizeof(data);
+		while (enet_socket_receive(wake_socket, nullptr, &buffer, 1) > 0) {
+		}
+	}
+}
+
+uint16_t Network::assign_room(uint32_t requested) {
+	// Clients either ask for a specific room (counting from 1), or are put into the emptiest one
+	if (requested >= 1 && requested <= inboxes.size()) {
+		return static_cast<uint16_t>(requested - 1);
+	}
+	uint16_t room = 0;
+	for (uint16_t i = 1; i < inboxes.size(); ++i) {
+		if (inboxes[i]->clients < inboxes[room]->clients) {
+			room = i;
+		}
+	}
+	return room;
+}
+
+void Network::push_event(const NetworkEvent& event) {
+	Inbox& inbox = *inboxes[peer_rooms[event.client]];
+	inbox.events.push(event);
+	inbox.received = true;
+}
+
+void Network::count_sent(uint16_t client, uint8_t channel, size_t bytes) {
+	channel_bytes[channel] += bytes;
+	peer_stats[client].sent[channel] += bytes;
+}
+
+void Network::publish_stats() {
+	for (size_t i = 0; i < peers.size(); ++i) {
+		ENetPeer* peer = peers[i];
+		if (peer == nullptr) {
+			continue;
+		}
+		ClientStats& stats = peer_stats[i];
+		stats.ping = peer->roundTripTime;
+		stats.ping_variance = peer->roundTripTimeVariance;
+		stats.packet_loss = static_cast<float>(peer->packetLoss) / ENET_PEER_PACKET_LOSS_SCALE;
+		stats.throttle = static_cast<float>(peer->packetThrottle) / ENET_PEER_PACKET_THROTTLE_SCALE;
+		stats.queued = peer->reliableDataInTransit;
+		for (ENetList* list : { &peer->outgoingReliableCommands, &peer->outgoingUnreliableCommands }) {
+			for (ENetListIterator it = enet_list_begin(list); it != enet_list_end(list);
+				it = enet_list_next(it)) {
+				stats.queued += reinterpret_cast<ENetOutgoingCommand*>(it)->fragmentLength;
+			}
+		}
+	}
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	published_stats = peer_stats;
+}
+
+ENetPeer* Network::find_peer(uint16_t client, uint32_t generation) {
+	// Rooms learn about disconnects late, by then the slot might belong to someone else
+	if (client >= peers.size() || peer_generations[client] != generation) {
+		return nullptr;
+	}
+	return peers[client];
+}
+
+void Network::handle_message(Message& message) {
+	ENetPeer* peer;
+	switch (message.type) {
+	case Message::Type::SEND:
+		peer = find_peer(message.client, message.generation);
+		if (peer == nullptr || enet_peer_send(peer, message.channel, message.packet) < 0) {
+			enet_packet_destroy(message.packet);
+		}
+		else {
+			count_sent(message.client, message.channel, message.packet->dataLength);
+			if (message.channel == CONTENT_CHANNEL) {
+				content_in_flight[message.client] += message.packet->dataLength;
+				message.packet->userData = &content_in_flight[message.client];
+				message.packet->freeCallback = release_content;
+			}
+		}
+		break;
+	case Message::Type::BROADCAST:
+		for (size_t i = 0; i < peers.size(); ++i) {
+			if (peers[i] != nullptr) {
+				count_sent(static_cast<uint16_t>(i), message.channel, message.packet->dataLength);
+			}
+		}
+		enet_host_broadcast(host, message.channel, message.packet);
+		break;
+	case Message::Type::BROADCAST_ROOM:
+		for (size_t i = 0; i < peers.size(); ++i) {
+			if (peers[i] != nullptr && peer_rooms[i] == message.client &&
+				enet_peer_send(peers[i], message.channel, message.packet) == 0) {
+				count_sent(static_cast<uint16_t>(i), message.channel, message.packet->dataLength);
+			}
+		}
+		if (message.packet->referenceCount == 0) {
+			enet_packet_destroy(message.packet);
+		}
+		break;
+	case Message::Type::DISCONNECT:
+		peer = find_peer(message.client, message.generation);
+		if (peer != nullptr) {
+			enet_peer_disconnect(peer, 0);
+		}
+		break;
+	}
+}
@@ -0,0 +1,148 @@
+// Copyright 2023 Justus Zorn
+
+#ifndef ANOMALY_SERVER_NETWORK_H
+#define ANOMALY_SERVER_NETWORK_H
+
+#include <atomic>
+#include <condition_variable>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include <enet.h>
+
+#include <Anomaly.h>
+#include <Network/Compressor.h>
+#include <Server/Config.h>
+#include <Server/Profiler.h>
+#include <Server/Queue.h>
+
+struct NetworkEvent {
+	enum class Type {
+		CONNECT,
+		DISCONNECT,
+		RECEIVE
+	} type;
+	uint16_t client;
+	// Counts the connections to the client's slot, ENet reuses slots of disconnected peers
+	uint32_t generation;
+	uint8_t channel;
+	ENetPacket* packet;
+};
+
+// Connection quality and traffic of one client, published by the network thread every
+// NET_STATS_INTERVAL milliseconds
+struct ClientStats {
+	bool connected = false;
+	uint32_t generation = 0;
+	// Round trip time and its variance in milliseconds
+	uint32_t ping = 0;
+	uint32_t ping_variance = 0;
+	// Loss of reliable packets and the fraction of unreliable packets ENet still sends, 0 to 1
+	float packet_loss = 0.0f;
+	float throttle = 1.0f;
+	// Bytes waiting to be sent or acknowledged
+	uint64_t queued = 0;
+	// Payload bytes per channel, before compression
+	std::array<uint64_t, NET_CHANNELS> sent{};
+	std::array<uint64_t, NET_CHANNELS> received{};
+};
+
+// Owns the ENet host and services it on a dedicated thread, so that acknowledgements and pings
+// are handled independently of how long the scripts take. All other threads only exchange
+// events and packets with it through lock-free queues. Every room has its own event queue, and
+// clients are assigned to a room when they connect.
+class Network {
+public:
+	Network(const Config& config);
+	Network(const Network&) = delete;
+	~Network();
+
+	Network& operator=(const Network&) = delete;
+
+	bool poll(uint16_t room, NetworkEvent& event);
+	void wait(uint16_t room, uint32_t timeout);
+
+	// Packets and disconnects for a previous connection of the slot are dropped
+	void send(uint16_t client, uint32_t generation, uint8_t channel, ENetPacket* packet);
+	void broadcast(uint8_t channel, ENetPacket* packet);
+	void broadcast(uint16_t room, uint8_t channel, ENetPacket* packet);
+	void disconnect(uint16_t client, uint32_t generation);
+
+	Profiler& get_profiler();
+	void report_traffic(std::ostream& output);
+	bool get_stats(uint16_t client, uint32_t generation, ClientStats& stats);
+	// Bytes of content chunks that have been handed to ENet but not acknowledged yet, kept up to
+	// date by the network thread
+	uint64_t get_content_in_flight(uint16_t client) const;
+
+	static const char* get_channel_name(uint8_t channel);
+
+private:
+	struct Message {
+		enum class Type {
+			SEND,
+			BROADCAST,
+			BROADCAST_ROOM,
+			DISCONNECT
+		} type;
+		// The room for BROADCAST_ROOM
+		uint16_t client;
+		uint32_t generation;
+		uint8_t channel;
+		ENetPacket* packet;
+	};
+
+	struct Inbox {
+		Queue<NetworkEvent> events;
+		std::mutex wake_mutex;
+		std::condition_variable wake;
+		bool pending_events = false;
+		bool received = false;
+		uint16_t clients = 0;
+	};
+
+	ENetHost* host;
+	// Rooms send a datagram to this socket when they queue the first message since the network
+	// thread last emptied the queue, which wakes it up
+	ENetSocket wake_socket = ENET_SOCKET_NULL;
+	ENetAddress wake_address;
+	std::atomic<bool> wake_pending = false;
+	Compression compression;
+	Compressor compressor;
+	std::vector<ENetPeer*> peers;
+	std::vector<uint16_t> peer_rooms;
+	std::vector<uint32_t> peer_generations;
+
+	std::vector<std::unique_ptr<Inbox>> inboxes;
+	Queue<Message> messages;
+
+	Profiler profiler;
+	// Payload bytes queued per channel, before compression
+	std::array<std::atomic<uint64_t>, NET_CHANNELS> channel_bytes{};
+	// Updated by the network thread as packets are sent and received, and copied to
+	// published_stats periodically
+	std::vector<ClientStats> peer_stats;
+	std::vector<ClientStats> published_stats;
+	std::vector<std::atomic<uint64_t>> content_in_flight;
+	std::mutex stats_mutex;
+	uint32_t next_stats = 0;
+
+	std::atomic<bool> running = true;
+	std::thread thread;
+
+	void run();
+	void wake();
+	void wait_for_traffic();
+	void handle_message(Message& message);
+	ENetPeer* find_peer(uint16_t client, uint32_t generation);
+	uint16_t assign_room(uint32_t requested);
+	void push_event(const NetworkEvent& event);
+	void count_sent(uint16_t client, uint8_t channel, size_t bytes);
+	void publish_stats();
+};
+
+#endif
@@ -0,0 +1,114 @@
+// Copyright 2023 Justus Zorn
+
+#include <algorithm>
+#include <iomanip>
+
+#include <Anomaly.h>
+#include <Server/Profiler.h>
+
+static const char* phase_names[] = {
+	"network service",
+	"network send",
+	"input",
+	"on_join",
+	"on_quit",
+	"on_key_*",
+	"on_finger_*",
+	"on_mouse_*",
+	"on_tick",
+	"encode",
+	"send",
+	"reload",
+	"tick interval",
+	"tick lateness"
+};
+
+static const double lateness_buckets[] = { 0.001, 0.002, 0.005, 0.01, 0.02, 0.05 };
+
+Profiler::Profiler(const std::string& name) : name{ name } {
+	for (Samples& phase : samples) {
+		phase.window.reserve(PROFILER_WINDOW);
+	}
+}
+
+void Profiler::record(Phase phase, double seconds) {
+	std::lock_guard<std::mutex> lock(mutex);
+	Samples& phase_samples = samples[static_cast<size_t>(phase)];
+	if (phase_samples.window.size() < PROFILER_WINDOW) {
+		phase_samples.window.push_back(static_cast<float>(seconds));
+	}
+	else {
+		phase_samples.window[phase_samples.next] = static_cast<float>(seconds);
+	}
+	phase_samples.next = (phase_samples.next + 1) % PROFILER_WINDOW;
+	++phase_samples.count;
+}
+
+void Profiler::count_overrun(uint64_t missed_ticks) {
+	std::lock_guard<std::mutex> lock(mutex);
+	++overruns;
+	missed += missed_ticks;
+}
+
+void Profiler::report(std::ostream& output) {
+	std::array<std::vector<float>, static_cast<size_t>(Phase::COUNT)> windows;
+	std::array<uint64_t, static_cast<size_t>(Phase::COUNT)> counts;
+	uint64_t overruns, missed;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = 0; i < samples.size(); ++i) {
+			windows[i] = samples[i].window;
+			counts[i] = samples[i].count;
+		}
+		overruns = this->overruns;
+		missed = this->missed;
+	}
+
+	output << "INFO: Profile of " << name << " (overruns: " << overruns << ", missed ticks: " <<
+		missed << ")\n";
+	output << "      " << std::left << std::setw(16) << "phase" << std::right << std::setw(10) <<
+		"count" << std::setw(10) << "p50 ms" << std::setw(10) << "p95 ms" << std::setw(10) <<
+		"p99 ms" << std::setw(10) << "max ms" << '\n';
+	output << std::fixed << std::setprecision(3);
+	for (size_t i = 0; i < windows.size(); ++i) {
+		std::vector<float>& window = windows[i];
+		if (window.empty()) {
+			continue;
+		}
+		auto percentile = [&window](double p) {
+			size_t index = std::min(window.size() - 1, static_cast<size_t>(p * window.size()));
+			std::nth_element(window.begin(), window.begin() + index, window.end());
+			return window[index] * 1000.0;
+		};
+		double p50 = percentile(0.5);
+		double p95 = percentile(0.95);
+		double p99 = percentile(0.99);
+		double max = *std::max_element(window.begin(), window.end()) * 1000.0;
+		output << "      " << std::left << std::setw(16) << phase_names[i] << std::right <<
+			std::setw(10) << counts[i] << std::setw(10) << p50 << std::setw(10) << p95 <<
+			std::setw(10) << p99 << std::setw(10) << max << '\n';
+	}
+
+	const std::vector<float>& lateness = windows[static_cast<size_t>(Phase::TICK_LATENESS)];
+	if (!lateness.empty()) {
+		// Histogram of how late ticks started compared to their schedule
+		output << "      tick lateness histogram:";
+		size_t previous = 0;
+		for (double bucket : lateness_buckets) {
+			size_t count = std::count_if(lateness.begin(), lateness.end(),
+				[bucket](float value) { return value < bucket; });
+			output << " <" << static_cast<int>(bucket * 1000.0) << "ms: " << count - previous;
+			previous = count;
+		}
+		output << " more: " << lateness.size() - previous << '\n';
+	}
+	output << std::defaultfloat;
+}
+
+ProfileScope::ProfileScope(Profiler& profiler, Phase phase)
+	: profiler{ &profiler }, phase{ phase }, start{ std::chrono::steady_clock::now() } {}
+
+ProfileScope::~ProfileScope() {
+	std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+	profiler->record(phase, duration.count());
+}
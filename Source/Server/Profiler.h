@@ -0,0 +1,73 @@
+// Copyright 2023 Justus Zorn
+
+#ifndef ANOMALY_SERVER_PROFILER_H
+#define ANOMALY_SERVER_PROFILER_H
+
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+enum class Phase {
+	NETWORK_SERVICE,
+	NETWORK_SEND,
+	INPUT,
+	ON_JOIN,
+	ON_QUIT,
+	ON_KEY,
+	ON_FINGER,
+	ON_MOUSE,
+	ON_TICK,
+	ENCODE,
+	SEND,
+	RELOAD,
+	TICK_INTERVAL,
+	TICK_LATENESS,
+	COUNT
+};
+
+// Keeps the most recent durations of every phase, so that percentiles can be reported for a
+// rolling window. Recording is cheap enough to always be enabled.
+class Profiler {
+public:
+	Profiler(const std::string& name);
+	Profiler(const Profiler&) = delete;
+
+	Profiler& operator=(const Profiler&) = delete;
+
+	void record(Phase phase, double seconds);
+	void count_overrun(uint64_t missed_ticks);
+
+	void report(std::ostream& output);
+
+private:
+	struct Samples {
+		std::vector<float> window;
+		size_t next = 0;
+		uint64_t count = 0;
+	};
+
+	std::string name;
+	std::mutex mutex;
+	std::array<Samples, static_cast<size_t>(Phase::COUNT)> samples;
+	uint64_t overruns = 0;
+	uint64_t missed = 0;
+};
+
+class ProfileScope {
+public:
+	ProfileScope(Profiler& profiler, Phase phase);
+	ProfileScope(const ProfileScope&) = delete;
+	~ProfileScope();
+
+	ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+	Profiler* profiler;
+	Phase phase;
+	std::chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,56 @@
+// Copyright 2023 Justus Zorn
+
+#ifndef ANOMALY_SERVER_QUEUE_H
+#define ANOMALY_SERVER_QUEUE_H
+
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free queue for any number of producers and a single consumer.
+template <typename T>
+class Queue {
+public:
+	Queue() {
+		tail = new Node;
+		head.store(tail, std::memory_order_relaxed);
+	}
+
+	Queue(const Queue&) = delete;
+
+	~Queue() {
+		T value;
+		while (pop(value)) {}
+		delete tail;
+	}
+
+	Queue& operator=(const Queue&) = delete;
+
+	void push(T value) {
+		Node* node = new Node;
+		node->value = std::move(value);
+		Node* previous = head.exchange(node, std::memory_order_acq_rel);
+		previous->next.store(node, std::memory_order_release);
+	}
+
+	bool pop(T& value) {
+		Node* next = tail->next.load(std::memory_order_acquire);
+		if (next == nullptr) {
+			return false;
+		}
+		value = std::move(next->value);
+		delete tail;
+		tail = next;
+		return true;
+	}
+
+private:
+	struct Node {
+		T value;
+		std::atomic<Node*> next = nullptr;
+	};
+
+	std::atomic<Node*> head;
+	Node* tail;
+};
+
+#endif
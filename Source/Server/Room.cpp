@@ -0,0 +1,114 @@
+// Copyright 2023 Justus Zorn
+
+#include <algorithm>
+#include <chrono>
+
+#include <Server/ContentManager.h>
+#include <Server/Room.h>
+#include <Server/Script.h>
+
+Room::Room(uint16_t index, const Config& config, ContentManager& content, Network& network,
+	ThreadPool& pool) : index{ index }, config{ &config }, content{ &content }, server(content, network, pool, index, config) {}
+
+Server& Room::get_server() {
+	return server;
+}
+
+void Room::start() {
+	thread = std::thread(&Room::run, this);
+}
+
+void Room::reload_scripts(const std::vector<std::string>& modules) {
+	std::lock_guard<std::mutex> lock(modules_mutex);
+	changed_modules.insert(changed_modules.end(), modules.begin(), modules.end());
+	scripts_changed = true;
+}
+
+void Room::run() {
+	// Every room has its own Lua state, so every room also gets its own profile
+	std::string profile_path = config->lua_profile;
+	if (!profile_path.empty() && config->rooms > 1) {
+		profile_path += '.' + std::to_string(index + 1);
+	}
+	// The Lua state is created on the room thread and never leaves it
+	Script script(server, profile_path, config->lua_profile_interval);
+
+	using Clock = std::chrono::steady_clock;
+	const double tick_seconds = 1.0 / config->tick_rate;
+	const auto tick_time = std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<double>(tick_seconds));
+	// Sending more often than simulating would only repeat identical frames
+	const auto send_time = std::max(tick_time, std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<double>(1.0 / config->send_rate)));
+
+	Profiler& profiler = server.get_profiler();
+	auto next_tick = Clock::now();
+	auto next_send = next_tick;
+	auto last_tick = next_tick;
+	while (true) {
+		if (!server.has_clients()) {
+			// Nobody to simulate for, so sleep until the next network event arrives
+			server.service(script, IDLE_SERVICE_TIMEOUT);
+			next_tick = Clock::now();
+			next_send = next_tick;
+			last_tick = next_tick;
+		}
+		else {
+			auto now = Clock::now();
+			if (now < next_tick) {
+				// Sleep until the next tick is due, handling input as soon as it arrives
+				auto remaining = std::chrono::ceil<std::chrono::milliseconds>(next_tick - now);
+				server.service(script, static_cast<uint32_t>(remaining.count()));
+				continue;
+			}
+			profiler.record(Phase::TICK_LATENESS, std::chrono::duration<double>(now - next_tick).count());
+			profiler.record(Phase::TICK_INTERVAL, std::chrono::duration<double>(now - last_tick).count());
+			last_tick = now;
+			uint32_t steps = 0;
+			while (now >= next_tick && steps < config->max_catch_up_steps) {
+				server.tick(script, tick_seconds);
+				next_tick += tick_time;
+				++steps;
+			}
+			if (now >= next_tick) {
+				// The script could not keep up, so either fold the missed steps into one
+				// long tick or give up on simulating them at all
+				auto missed = (now - next_tick) / tick_time + 1;
+				profiler.count_overrun(missed);
+				if (config->catch_up_policy == CatchUpPolicy::MERGE) {
+					server.tick(script, missed * tick_seconds);
+				}
+				next_tick += missed * tick_time;
+			}
+			if (now >= next_send) {
+				server.send();
+				next_send += send_time;
+				if (next_send <= now) {
+					next_send = now + send_time;
+				}
+			}
+		}
+		if (scripts_changed.exchange(false)) {
+			std::vector<std::string> modules;
+			{
+				std::lock_guard<std::mutex> lock(modules_mutex);
+				std::swap(modules, changed_modules);
+			}
+			ProfileScope scope(profiler, Phase::RELOAD);
+			// The main script can only be run again as a whole
+			if (config->hot_reload == HotReload::MODULES &&
+				std::find(modules.begin(), modules.end(), "main") == modules.end()) {
+				script.reload_modules(modules);
+			}
+			else {
+				script.reload();
+			}
+		}
+		auto reload_start = Clock::now();
+		if (script.check_reload()) {
+			content->reload(server);
+			profiler.record(Phase::RELOAD,
+				std::chrono::duration<double>(Clock::now() - reload_start).count());
+		}
+	}
+}
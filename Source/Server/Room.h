@@ -0,0 +1,45 @@
+// Copyright 2023 Justus Zorn
+
+#ifndef ANOMALY_SERVER_ROOM_H
+#define ANOMALY_SERVER_ROOM_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Server/Config.h>
+#include <Server/Server.h>
+
+// A room is one independent game: its own set of players and its own Lua state, simulated on
+// its own thread. Content is shared between all rooms of a server.
+class Room {
+public:
+	Room(uint16_t index, const Config& config, ContentManager& content, Network& network,
+		ThreadPool& pool);
+	Room(const Room&) = delete;
+
+	Room& operator=(const Room&) = delete;
+
+	Server& get_server();
+
+	void start();
+	void reload_scripts(const std::vector<std::string>& modules);
+
+private:
+	uint16_t index;
+	const Config* config;
+	ContentManager* content;
+	Server server;
+	std::thread thread;
+
+	// Lua modules that changed on disk, reloaded by the room thread
+	std::mutex modules_mutex;
+	std::vector<std::string> changed_modules;
+	std::atomic<bool> scripts_changed = false;
+
+	void run();
+};
+
+#endif
@@ -1,9 +1,12 @@
 // Copyright 2023 Justus Zorn
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <unordered_map>
 
 #include <Server/Script.h>
+#include <Server/ScriptProfiler.h>
 #include <Server/Server.h>
 
 std::unordered_map<int32_t, const char*> keycodes = {
@@ -67,17 +70,32 @@ std::unordered_map<int32_t, const char*> keycodes = {
 	{ 1073742094, "Back" }
 };
 
-Script::Script(Server& server) : server{ &server } {
+Script::Script(Server& server, const std::string& profile_path, uint32_t profile_interval)
+	: server{ &server } {
 	L = luaL_newstate();
 	if (!L) {
 		std::cerr << "ERROR: Could not initialize Lua\n";
 		return;
 	}
 	luaL_openlibs(L);
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaded");
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		lua_pop(L, 1);
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			builtin_modules.push_back(lua_tostring(L, -1));
+		}
+	}
+	lua_settop(L, 0);
+	if (!profile_path.empty()) {
+		profiler = std::make_unique<ScriptProfiler>(L, profile_path, profile_interval);
+	}
 	reload();
 }
 
 Script::~Script() {
+	profiler.reset();
 	lua_close(L);
 }
 
@@ -87,13 +105,45 @@ void Script::reload() {
 	register_callback("start_text_input", start_text_input);
 	register_callback("stop_text_input", stop_text_input);
 	register_callback("get_composition", get_composition);
+	register_callback("get_ping", get_ping);
+	register_callback("get_net_stats", get_net_stats);
+	register_callback("image", image);
+	register_callback("font", font);
+	register_callback("sound", sound);
 	register_callback("get_sprite_width", get_sprite_width);
 	register_callback("draw_sprite", draw_sprite);
 	register_callback("draw_text", draw_text);
+	register_callback("draw_sprite_all", draw_sprite_all);
+	register_callback("draw_text_all", draw_text_all);
+	register_callback("draw_sprites", draw_sprites);
+	register_callback("draw_texts", draw_texts);
+	register_callback("create_sprite", create_sprite);
+	register_callback("set_sprite_position", set_sprite_position);
+	register_callback("set_sprite_visible", set_sprite_visible);
+	register_callback("destroy_sprite", destroy_sprite);
+	register_callback("preload", preload);
 	register_callback("kick", kick);
 	register_callback("play_sound", play_sound);
+	register_callback("play_sound_all", play_sound_all);
 	register_callback("stop_sound", stop_sound);
 	register_callback("stop_all_sounds", stop_all_sounds);
+	// Modules are required again by main.lua, instead of returning what the old scripts were
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaded");
+	std::vector<std::string> modules;
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		lua_pop(L, 1);
+		if (lua_type(L, -1) == LUA_TSTRING && std::find(builtin_modules.begin(),
+			builtin_modules.end(), lua_tostring(L, -1)) == builtin_modules.end()) {
+			modules.push_back(lua_tostring(L, -1));
+		}
+	}
+	for (const std::string& module : modules) {
+		lua_pushnil(L);
+		lua_setfield(L, -2, module.c_str());
+	}
+	lua_settop(L, 0);
 	if (luaL_dofile(L, "Content/Scripts/main.lua") != LUA_OK) {
 		std::cerr << "ERROR: Could not load lua file 'Content/Scripts/main.lua': " <<
 			lua_tostring(L, -1) << '\n';
@@ -102,10 +152,53 @@ void Script::reload() {
 	on_reload();
 }
 
+void Script::reload_modules(const std::vector<std::string>& modules) {
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaded");
+	int loaded = lua_gettop(L);
+	for (const std::string& module : modules) {
+		// Modules that have never been required are loaded once they are
+		if (lua_getfield(L, loaded, module.c_str()) == LUA_TNIL) {
+			lua_pop(L, 1);
+			continue;
+		}
+		int old = lua_gettop(L);
+		lua_pushnil(L);
+		lua_setfield(L, loaded, module.c_str());
+		lua_getglobal(L, "require");
+		lua_pushstring(L, module.c_str());
+		if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+			std::cerr << "ERROR: Could not reload module '" << module << "': " <<
+				lua_tostring(L, -1) << '\n';
+			lua_pushvalue(L, old);
+			lua_setfield(L, loaded, module.c_str());
+			lua_settop(L, loaded);
+			continue;
+		}
+		if (lua_istable(L, old) && lua_istable(L, -1)) {
+			// The new functions are copied into the old table, so that everybody holding on to
+			// the module sees them
+			lua_pushnil(L);
+			while (lua_next(L, -2) != 0) {
+				lua_pushvalue(L, -2);
+				lua_insert(L, -2);
+				lua_settable(L, old);
+			}
+			lua_pushvalue(L, old);
+			lua_setfield(L, loaded, module.c_str());
+		}
+		std::cout << "INFO: Reloaded module '" << module << "'\n";
+		lua_settop(L, loaded);
+	}
+	lua_settop(L, 0);
+	on_reload();
+}
+
 void Script::on_tick(double dt) {
+	ProfileScope scope(server->get_profiler(), Phase::ON_TICK);
 	if (get_function("on_tick")) {
 		lua_pushnumber(L, dt);
-		if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+		if (call("on_tick", 1) != LUA_OK) {
 			std::cerr << "ERROR: Could not call on_tick: " << lua_tostring(L, -1) << '\n';
 		}
 	}
@@ -114,7 +207,7 @@ void Script::on_tick(double dt) {
 
 void Script::on_reload() {
 	if (get_function("on_reload")) {
-		if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+		if (call("on_reload", 0) != LUA_OK) {
 			std::cerr << "ERROR: Could not call on_reload: " << lua_tostring(L, -1) << '\n';
 		}
 	}
@@ -122,10 +215,11 @@ void Script::on_reload() {
 }
 
 void Script::on_join(uint16_t client, bool has_touch) {
+	ProfileScope scope(server->get_profiler(), Phase::ON_JOIN);
 	if (get_function("on_join")) {
 		lua_pushinteger(L, client);
 		lua_pushboolean(L, has_touch);
-		if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+		if (call("on_join", 2) != LUA_OK) {
 			std::cerr << "ERROR: Could not call on_join: " << lua_tostring(L, -1) << '\n';
 		}
 	}
@@ -133,9 +227,10 @@ void Script::on_join(uint16_t client, bool has_touch) {
 }
 
 void Script::on_quit(uint16_t client) {
+	ProfileScope scope(server->get_profiler(), Phase::ON_QUIT);
 	if (get_function("on_quit")) {
 		lua_pushinteger(L, client);
-		if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+		if (call("on_quit", 1) != LUA_OK) {
 			std::cerr << "ERROR: Could not call on_quit: " << lua_tostring(L, -1) << '\n';
 		}
 	}
@@ -143,13 +238,14 @@ void Script::on_quit(uint16_t client) {
 }
 
 void Script::on_key_event(uint16_t client, int32_t key, bool down) {
+	ProfileScope scope(server->get_profiler(), Phase::ON_KEY);
 	const char* method = down ? "on_key_down" : "on_key_up";
 	if (get_function(method)) {
 		auto it = keycodes.find(key);
 		if (it != keycodes.end()) {
 			lua_pushinteger(L, client);
 			lua_pushstring(L, it->second);
-			if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+			if (call(method, 2) != LUA_OK) {
 				std::cerr << "ERROR: Could not call " << method << ": " << lua_tostring(L, -1) <<
 					'\n';
 			}
@@ -162,6 +258,7 @@ void Script::on_key_event(uint16_t client, int32_t key, bool down) {
 }
 
 void Script::on_finger_event(uint16_t client, float x, float y, uint8_t finger, uint8_t type) {
+	ProfileScope scope(server->get_profiler(), Phase::ON_FINGER);
 	const char* method = nullptr;
 	switch (static_cast<InputEventType>(type)) {
 	case InputEventType::DOWN:
@@ -179,7 +276,7 @@ void Script::on_finger_event(uint16_t client, float x, float y, uint8_t finger,
 		lua_pushinteger(L, finger);
 		lua_pushnumber(L, x);
 		lua_pushnumber(L, y);
-		if (lua_pcall(L, 4, 0, 0) != LUA_OK) {
+		if (call(method, 4) != LUA_OK) {
 			std::cerr << "ERROR: Could not call " << method << ": " << lua_tostring(L, -1) << '\n';
 		}
 	}
@@ -187,6 +284,7 @@ void Script::on_finger_event(uint16_t client, float x, float y, uint8_t finger,
 }
 
 void Script::on_mouse_button(uint16_t client, float x, float y, uint8_t button, bool down) {
+	ProfileScope scope(server->get_profiler(), Phase::ON_MOUSE);
 	const char* method = down ? "on_mouse_button_down" : "on_mouse_button_up";
 	if (get_function(method)) {
 		lua_pushinteger(L, client);
@@ -209,7 +307,7 @@ void Script::on_mouse_button(uint16_t client, float x, float y, uint8_t button,
 		}
 		lua_pushnumber(L, x);
 		lua_pushnumber(L, y);
-		if (lua_pcall(L, 4, 0, 0) != LUA_OK) {
+		if (call(method, 4) != LUA_OK) {
 			std::cerr << "ERROR: Could not call " << method << ": " << lua_tostring(L, -1) << '\n';
 		}
 	}
@@ -217,11 +315,12 @@ void Script::on_mouse_button(uint16_t client, float x, float y, uint8_t button,
 }
 
 void Script::on_mouse_motion(uint16_t client, float x, float y) {
+	ProfileScope scope(server->get_profiler(), Phase::ON_MOUSE);
 	if (get_function("on_mouse_motion")) {
 		lua_pushinteger(L, client);
 		lua_pushnumber(L, x);
 		lua_pushnumber(L, y);
-		if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
+		if (call("on_mouse_motion", 3) != LUA_OK) {
 			std::cerr << "ERROR: Could not call on_mouse_motion: " << lua_tostring(L, -1) << '\n';
 		}
 	}
@@ -229,11 +328,12 @@ void Script::on_mouse_motion(uint16_t client, float x, float y) {
 }
 
 void Script::on_mouse_wheel(uint16_t client, float x, float y) {
+	ProfileScope scope(server->get_profiler(), Phase::ON_MOUSE);
 	if (get_function("on_mouse_wheel")) {
 		lua_pushinteger(L, client);
 		lua_pushnumber(L, x);
 		lua_pushnumber(L, y);
-		if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
+		if (call("on_mouse_wheel", 3) != LUA_OK) {
 			std::cerr << "ERROR: Could not call on_mouse_wheel: " << lua_tostring(L, -1) << '\n';
 		}
 	}
@@ -292,34 +392,128 @@ int Script::get_composition(lua_State* L) {
 	}
 }
 
+int Script::get_ping(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	int client = luaL_checkinteger(L, 1);
+	ClientStats stats;
+	if (!script->server->get_net_stats(client, stats)) {
+		return luaL_error(L, "Client %d is not online", client);
+	}
+	lua_pushinteger(L, stats.ping);
+	return 1;
+}
+
+static void push_channel_bytes(lua_State* L, const std::array<uint64_t, NET_CHANNELS>& bytes) {
+	lua_createtable(L, 0, NET_CHANNELS);
+	for (uint8_t i = 0; i < NET_CHANNELS; ++i) {
+		lua_pushinteger(L, static_cast<lua_Integer>(bytes[i]));
+		lua_setfield(L, -2, Network::get_channel_name(i));
+	}
+}
+
+int Script::get_net_stats(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	int client = luaL_checkinteger(L, 1);
+	ClientStats stats;
+	if (!script->server->get_net_stats(client, stats)) {
+		return luaL_error(L, "Client %d is not online", client);
+	}
+	lua_createtable(L, 0, 7);
+	lua_pushinteger(L, stats.ping);
+	lua_setfield(L, -2, "ping");
+	lua_pushinteger(L, stats.ping_variance);
+	lua_setfield(L, -2, "ping_variance");
+	lua_pushnumber(L, stats.packet_loss);
+	lua_setfield(L, -2, "packet_loss");
+	lua_pushnumber(L, stats.throttle);
+	lua_setfield(L, -2, "throttle");
+	lua_pushinteger(L, static_cast<lua_Integer>(stats.queued));
+	lua_setfield(L, -2, "queued");
+	push_channel_bytes(L, stats.sent);
+	lua_setfield(L, -2, "sent");
+	push_channel_bytes(L, stats.received);
+	lua_setfield(L, -2, "received");
+	return 1;
+}
+
+static const char* content_names[] = {
+	"Image",
+	"Font",
+	"Sound"
+};
+
+// Content can be named by its path or by a handle, handles do not have to be looked up at all
+static uint32_t check_content(lua_State* L, int index, ContentType type, Server* server) {
+	if (lua_type(L, index) == LUA_TNUMBER) {
+		int is_integer;
+		lua_Integer handle = lua_tointegerx(L, index, &is_integer);
+		if (!is_integer || (handle & ((1 << CONTENT_HANDLE_BITS) - 1)) != static_cast<int>(type) ||
+			handle < (1 << CONTENT_HANDLE_BITS) || handle > UINT32_MAX) {
+			luaL_error(L, "%s handle is invalid", content_names[static_cast<size_t>(type)]);
+		}
+		uint32_t id = static_cast<uint32_t>(handle >> CONTENT_HANDLE_BITS);
+		// Every ID ever handed out stays valid, anything else would make clients track unbounded
+		// IDs
+		if (!server->has_content_id(type, id)) {
+			luaL_error(L, "%s %I is not loaded", content_names[static_cast<size_t>(type)], handle);
+		}
+		return id;
+	}
+	size_t length;
+	const char* path = luaL_checklstring(L, index, &length);
+	uint32_t id = server->get_content_id(type, std::string_view(path, length));
+	if (id == 0) {
+		luaL_error(L, "%s %s is not loaded", content_names[static_cast<size_t>(type)], path);
+	}
+	return id;
+}
+
+static int push_handle(lua_State* L, ContentType type, Server* server) {
+	uint32_t id = check_content(L, 1, type, server);
+	lua_pushinteger(L, static_cast<lua_Integer>(id) << CONTENT_HANDLE_BITS |
+		static_cast<lua_Integer>(type));
+	return 1;
+}
+
+int Script::image(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	return push_handle(L, ContentType::IMAGE, script->server);
+}
+
+int Script::font(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	return push_handle(L, ContentType::FONT, script->server);
+}
+
+int Script::sound(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	return push_handle(L, ContentType::SOUND, script->server);
+}
+
 int Script::get_sprite_width(lua_State* L) {
 	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
-	std::string path = luaL_checkstring(L, 1);
-	lua_pushnumber(L, script->server->get_sprite_width(path));
+	uint32_t id = check_content(L, 1, ContentType::IMAGE, script->server);
+	lua_pushnumber(L, script->server->get_sprite_width(id));
 	return 1;
 }
 
 int Script::draw_sprite(lua_State* L) {
 	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
 	int client = luaL_checkinteger(L, 1);
-	std::string path = luaL_checkstring(L, 2);
+	uint32_t id = check_content(L, 2, ContentType::IMAGE, script->server);
 	float x = luaL_checknumber(L, 3);
 	float y = luaL_checknumber(L, 4);
 	float scale = luaL_checknumber(L, 5);
-	int result = script->server->draw_sprite(client, path, x, y, scale);
-	if (result == 1) {
+	if (!script->server->draw_sprite(client, id, x, y, scale)) {
 		luaL_error(L, "Client %d is not online", client);
 	}
-	else if (result == 2) {
-		luaL_error(L, "Image %s is not loaded", path.c_str());
-	}
 	return 0;
 }
 
 int Script::draw_text(lua_State* L) {
 	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
 	int client = luaL_checkinteger(L, 1);
-	std::string path = luaL_checkstring(L, 2);
+	uint32_t id = check_content(L, 2, ContentType::FONT, script->server);
 	float x = luaL_checknumber(L, 3);
 	float y = luaL_checknumber(L, 4);
 	float scale = luaL_checknumber(L, 5);
@@ -327,12 +521,247 @@ int Script::draw_text(lua_State* L) {
 	uint8_t g = luaL_checknumber(L, 7);
 	uint8_t b = luaL_checknumber(L, 8);
 	std::string text = luaL_checkstring(L, 9);
-	int result = script->server->draw_text(client, path, x, y, scale, r, g, b, text);
+	if (!script->server->draw_text(client, id, x, y, scale, r, g, b, text)) {
+		return luaL_error(L, "Client %d is not online", client);
+	}
+	return 0;
+}
+
+int Script::draw_sprite_all(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	uint32_t id = check_content(L, 1, ContentType::IMAGE, script->server);
+	float x = luaL_checknumber(L, 2);
+	float y = luaL_checknumber(L, 3);
+	float scale = luaL_checknumber(L, 4);
+	script->server->draw_shared_sprite(id, x, y, scale);
+	return 0;
+}
+
+int Script::draw_text_all(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	uint32_t id = check_content(L, 1, ContentType::FONT, script->server);
+	float x = luaL_checknumber(L, 2);
+	float y = luaL_checknumber(L, 3);
+	float scale = luaL_checknumber(L, 4);
+	uint8_t r = luaL_checknumber(L, 5);
+	uint8_t g = luaL_checknumber(L, 6);
+	uint8_t b = luaL_checknumber(L, 7);
+	std::string text = luaL_checkstring(L, 8);
+	script->server->draw_shared_text(id, x, y, scale, r, g, b, text);
+	return 0;
+}
+
+// Lua interns short strings, so entries naming the same image or font usually share one pointer
+// and only need to be resolved once per batch
+static uint32_t resolve_id(lua_State* L, int index, ContentType type, Server* server,
+	const char*& last_path, uint32_t& last_id) {
+	if (lua_type(L, index) != LUA_TSTRING) {
+		return check_content(L, index, type, server);
+	}
+	const char* path = lua_tostring(L, index);
+	if (path != last_path) {
+		last_id = check_content(L, index, type, server);
+		last_path = path;
+	}
+	return last_id;
+}
+
+static float get_field(lua_State* L, int entry, int field, lua_Integer index) {
+	lua_rawgeti(L, entry, field);
+	int is_number;
+	float value = lua_tonumberx(L, -1, &is_number);
+	if (!is_number) {
+		luaL_error(L, "Entry %d has no number at index %d", static_cast<int>(index), field);
+	}
+	lua_pop(L, 1);
+	return value;
+}
+
+int Script::draw_sprites(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	int client = luaL_checkinteger(L, 1);
+	script->batch.clear();
+	if (!lua_istable(L, 2)) {
+		// draw_sprites(player, sprite, data) with data made of string.pack("fff", x, y, scale)
+		uint32_t id = check_content(L, 2, ContentType::IMAGE, script->server);
+		size_t length;
+		const char* data = luaL_checklstring(L, 3, &length);
+		if (length % (3 * sizeof(float)) != 0) {
+			return luaL_error(L, "Packed sprite data must consist of 3 floats per sprite");
+		}
+		script->batch.reserve(length / (3 * sizeof(float)));
+		for (size_t i = 0; i < length; i += 3 * sizeof(float)) {
+			float values[3];
+			memcpy(values, data + i, sizeof(values));
+			script->batch.push_back({ false, id, values[0], values[1], values[2], 0, 0, 0, "" });
+		}
+	}
+	else {
+		// draw_sprites(player, { { sprite, x, y, scale }, ... }), every entry is pushed to index 3
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_settop(L, 2);
+		lua_Integer count = luaL_len(L, 2);
+		script->batch.reserve(count);
+		const char* last_path = nullptr;
+		uint32_t last_id = 0;
+		for (lua_Integer i = 1; i <= count; ++i) {
+			if (lua_rawgeti(L, 2, i) != LUA_TTABLE) {
+				return luaL_error(L, "Entry %d is not a table", static_cast<int>(i));
+			}
+			if (lua_rawgeti(L, 3, 1) == LUA_TNIL) {
+				return luaL_error(L, "Entry %d has no image", static_cast<int>(i));
+			}
+			uint32_t id = resolve_id(L, -1, ContentType::IMAGE, script->server, last_path, last_id);
+			float x = get_field(L, 3, 2, i);
+			float y = get_field(L, 3, 3, i);
+			float scale = get_field(L, 3, 4, i);
+			script->batch.push_back({ false, id, x, y, scale, 0, 0, 0, "" });
+			lua_settop(L, 2);
+		}
+	}
+	if (!script->server->draw_sprites(client, script->batch)) {
+		return luaL_error(L, "Client %d is not online", client);
+	}
+	return 0;
+}
+
+int Script::draw_texts(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	int client = luaL_checkinteger(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	// Every entry is pushed to index 3
+	lua_settop(L, 2);
+	lua_Integer count = luaL_len(L, 2);
+	script->batch.clear();
+	script->batch.reserve(count);
+	const char* last_path = nullptr;
+	uint32_t last_id = 0;
+	for (lua_Integer i = 1; i <= count; ++i) {
+		// { font, x, y, scale, r, g, b, text }
+		if (lua_rawgeti(L, 2, i) != LUA_TTABLE) {
+			return luaL_error(L, "Entry %d is not a table", static_cast<int>(i));
+		}
+		if (lua_rawgeti(L, 3, 1) == LUA_TNIL) {
+			return luaL_error(L, "Entry %d has no font", static_cast<int>(i));
+		}
+		uint32_t id = resolve_id(L, -1, ContentType::FONT, script->server, last_path, last_id);
+		float x = get_field(L, 3, 2, i);
+		float y = get_field(L, 3, 3, i);
+		float scale = get_field(L, 3, 4, i);
+		uint8_t r = get_field(L, 3, 5, i);
+		uint8_t g = get_field(L, 3, 6, i);
+		uint8_t b = get_field(L, 3, 7, i);
+		lua_rawgeti(L, 3, 8);
+		size_t length;
+		const char* text = lua_tolstring(L, -1, &length);
+		if (text == nullptr) {
+			return luaL_error(L, "Entry %d has no text", static_cast<int>(i));
+		}
+		script->batch.push_back({ true, id, x, y, scale, r, g, b, std::string(text, length) });
+		lua_settop(L, 2);
+	}
+	if (!script->server->draw_sprites(client, script->batch)) {
+		return luaL_error(L, "Client %d is not online", client);
+	}
+	return 0;
+}
+
+int Script::create_sprite(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	int client = luaL_checkinteger(L, 1);
+	uint32_t id = check_content(L, 2, ContentType::IMAGE, script->server);
+	float x = luaL_checknumber(L, 3);
+	float y = luaL_checknumber(L, 4);
+	float scale = luaL_checknumber(L, 5);
+	uint32_t handle = 0;
+	int result = script->server->create_sprite(client, id, x, y, scale, handle);
 	if (result == 1) {
 		return luaL_error(L, "Client %d is not online", client);
 	}
 	else if (result == 2) {
-		return luaL_error(L, "Font %s is not loaded", path.c_str());
+		return luaL_error(L, "Client %d has too many sprites", client);
+	}
+	lua_pushinteger(L, handle);
+	return 1;
+}
+
+int Script::set_sprite_position(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	int client = luaL_checkinteger(L, 1);
+	lua_Integer handle = luaL_checkinteger(L, 2);
+	float x = luaL_checknumber(L, 3);
+	float y = luaL_checknumber(L, 4);
+	float scale = luaL_checknumber(L, 5);
+	int result = script->server->set_sprite_position(client, static_cast<uint32_t>(handle), x, y, scale);
+	if (result == 1) {
+		return luaL_error(L, "Client %d is not online", client);
+	}
+	else if (result == 2) {
+		return luaL_error(L, "Sprite %d does not exist", static_cast<int>(handle));
+	}
+	return 0;
+}
+
+int Script::set_sprite_visible(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	int client = luaL_checkinteger(L, 1);
+	lua_Integer handle = luaL_checkinteger(L, 2);
+	luaL_checkany(L, 3);
+	bool visible = lua_toboolean(L, 3);
+	int result = script->server->set_sprite_visible(client, static_cast<uint32_t>(handle), visible);
+	if (result == 1) {
+		return luaL_error(L, "Client %d is not online", client);
+	}
+	else if (result == 2) {
+		return luaL_error(L, "Sprite %d does not exist", static_cast<int>(handle));
+	}
+	return 0;
+}
+
+int Script::destroy_sprite(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	int client = luaL_checkinteger(L, 1);
+	lua_Integer handle = luaL_checkinteger(L, 2);
+	int result = script->server->destroy_sprite(client, static_cast<uint32_t>(handle));
+	if (result == 1) {
+		return luaL_error(L, "Client %d is not online", client);
+	}
+	else if (result == 2) {
+		return luaL_error(L, "Sprite %d does not exist", static_cast<int>(handle));
+	}
+	return 0;
+}
+
+int Script::preload(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	int client = luaL_checkinteger(L, 1);
+	// Either a single path or a list of paths
+	if (!lua_istable(L, 2)) {
+		std::string path = luaL_checkstring(L, 2);
+		int result = script->server->preload(client, path);
+		if (result == 1) {
+			return luaL_error(L, "Client %d is not online", client);
+		}
+		else if (result == 2) {
+			return luaL_error(L, "Content %s is not loaded", path.c_str());
+		}
+		return 0;
+	}
+	lua_Integer count = luaL_len(L, 2);
+	for (lua_Integer i = 1; i <= count; ++i) {
+		lua_geti(L, 2, i);
+		const char* path = lua_tostring(L, -1);
+		if (path == nullptr) {
+			return luaL_error(L, "Invalid path at index %d", static_cast<int>(i));
+		}
+		int result = script->server->preload(client, path);
+		if (result == 1) {
+			return luaL_error(L, "Client %d is not online", client);
+		}
+		else if (result == 2) {
+			return luaL_error(L, "Content %s is not loaded", path);
+		}
+		lua_pop(L, 1);
 	}
 	return 0;
 }
@@ -349,28 +778,46 @@ int Script::kick(lua_State* L) {
 int Script::play_sound(lua_State* L) {
 	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
 	int client = luaL_checkinteger(L, 1);
-	std::string path = luaL_checkstring(L, 2);
+	uint32_t id = check_content(L, 2, ContentType::SOUND, script->server);
 	int volume = luaL_checkinteger(L, 3);
 	if (volume < 0 || volume > 128) {
 		return luaL_error(L, "Invalid volume, must be between 0 and 128");
 	}
-	int result;
+	bool result;
 	if (lua_gettop(L) > 3) {
 		uint16_t channel = luaL_checkinteger(L, 4);
 		if (channel >= ANOMALY_AUDIO_CHANNELS) {
 			return luaL_error(L, "Invalid channel, must be between 0 and %d",
 				static_cast<int>(ANOMALY_AUDIO_CHANNELS) / 2 - 1);
 		}
-		result = script->server->play(client, path, channel, volume);
+		result = script->server->play(client, id, channel, volume);
 	}
 	else {
-		result = script->server->play_any(client, path, volume);
+		result = script->server->play_any(client, id, volume);
 	}
-	if (result == 1) {
+	if (!result) {
 		return luaL_error(L, "Client %d is not online", client);
 	}
-	else if (result == 2) {
-		return luaL_error(L, "Sound %s is not loaded", path.c_str());
+	return 0;
+}
+
+int Script::play_sound_all(lua_State* L) {
+	Script* script = reinterpret_cast<Script*>(lua_touserdata(L, lua_upvalueindex(1)));
+	uint32_t id = check_content(L, 1, ContentType::SOUND, script->server);
+	int volume = luaL_checkinteger(L, 2);
+	if (volume < 0 || volume > 128) {
+		return luaL_error(L, "Invalid volume, must be between 0 and 128");
+	}
+	if (lua_gettop(L) > 2) {
+		uint16_t channel = luaL_checkinteger(L, 3);
+		if (channel >= ANOMALY_AUDIO_CHANNELS) {
+			return luaL_error(L, "Invalid channel, must be between 0 and %d",
+				static_cast<int>(ANOMALY_AUDIO_CHANNELS) / 2 - 1);
+		}
+		script->server->play_shared(id, channel, volume);
+	}
+	else {
+		script->server->play_any_shared(id, volume);
 	}
 	return 0;
 }
@@ -398,6 +845,16 @@ int Script::stop_all_sounds(lua_State* L) {
 	return 0;
 }
 
+int Script::call(const char* name, int args) {
+	if (!profiler) {
+		return lua_pcall(L, args, 0, 0);
+	}
+	profiler->begin(name);
+	int result = lua_pcall(L, args, 0, 0);
+	profiler->end();
+	return result;
+}
+
 bool Script::get_function(const char* name) {
 	lua_getglobal(L, name);
 	if (lua_isnil(L, -1)) {
@@ -3,21 +3,27 @@
 #ifndef ANOMALY_SERVER_SCRIPT_H
 #define ANOMALY_SERVER_SCRIPT_H
 
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <lua.hpp>
 
+#include <Anomaly.h>
+
 class Server;
+class ScriptProfiler;
 
 class Script {
 public:
-	Script(Server& server);
+	Script(Server& server, const std::string& profile_path, uint32_t profile_interval);
 	Script(const Script&) = delete;
 	~Script();
 
 	Script& operator=(const Script&) = delete;
 
 	void reload();
+	void reload_modules(const std::vector<std::string>& modules);
 
 	void on_tick(double dt);
 
@@ -36,9 +42,16 @@ public:
 private:
 	Server* server;
 	lua_State* L;
+	std::unique_ptr<ScriptProfiler> profiler;
 
 	bool should_reload = false;
 
+	// The libraries in package.loaded before any script ran, which are kept on reload
+	std::vector<std::string> builtin_modules;
+
+	// Reused by draw_sprites and draw_texts so that batches do not allocate every tick
+	std::vector<Sprite> batch;
+
 	void on_reload();
 	static int lua_reload(lua_State* L);
 
@@ -46,17 +59,36 @@ private:
 	static int stop_text_input(lua_State* L);
 	static int get_composition(lua_State* L);
 
+	static int get_ping(lua_State* L);
+	static int get_net_stats(lua_State* L);
+
+	static int image(lua_State* L);
+	static int font(lua_State* L);
+	static int sound(lua_State* L);
 	static int get_sprite_width(lua_State* L);
 
 	static int draw_sprite(lua_State* L);
 	static int draw_text(lua_State* L);
+	static int draw_sprite_all(lua_State* L);
+	static int draw_text_all(lua_State* L);
+	static int draw_sprites(lua_State* L);
+	static int draw_texts(lua_State* L);
+
+	static int create_sprite(lua_State* L);
+	static int set_sprite_position(lua_State* L);
+	static int set_sprite_visible(lua_State* L);
+	static int destroy_sprite(lua_State* L);
+
+	static int preload(lua_State* L);
 
 	static int kick(lua_State* L);
 
 	static int play_sound(lua_State* L);
+	static int play_sound_all(lua_State* L);
 	static int stop_sound(lua_State* L);
 	static int stop_all_sounds(lua_State* L);
 
+	int call(const char* name, int args);
 	bool get_function(const char* name);
 	void register_callback(const char* name, lua_CFunction callback);
 };
@@ -0,0 +1,98 @@
+// Copyright 2023 Justus Zorn
+
+#include <fstream>
+#include <iostream>
+
+#include <Anomaly.h>
+#include <Server/ScriptProfiler.h>
+
+ScriptProfiler::ScriptProfiler(lua_State* L, const std::string& path, uint32_t interval)
+	: L{ L }, path{ path }, last_write{ Clock::now() } {
+	// The extra space is copied into every coroutine, so the hook finds the profiler there too
+	*static_cast<ScriptProfiler**>(lua_getextraspace(L)) = this;
+	lua_sethook(L, hook, LUA_MASKCOUNT, static_cast<int>(interval));
+}
+
+ScriptProfiler::~ScriptProfiler() {
+	lua_sethook(L, nullptr, 0, 0);
+	write();
+}
+
+void ScriptProfiler::begin(const char* callback) {
+	this->callback = callback;
+	last_stack = callback;
+	last_sample = Clock::now();
+}
+
+void ScriptProfiler::end() {
+	if (!callback) {
+		return;
+	}
+	// Whatever ran after the last sample most likely still belongs to the same stack
+	auto now = Clock::now();
+	add(last_stack, now);
+	callback = nullptr;
+	if (std::chrono::duration<double>(now - last_write).count() >= SCRIPT_PROFILE_WRITE_INTERVAL) {
+		write();
+	}
+}
+
+void ScriptProfiler::write() {
+	last_write = Clock::now();
+	std::ofstream output(path, std::ios::trunc);
+	if (!output.is_open()) {
+		std::cerr << "ERROR: Could not write Lua profile '" << path << "'\n";
+		return;
+	}
+	for (const auto& [key, microseconds] : stacks) {
+		if (microseconds > 0) {
+			output << key << ' ' << microseconds << '\n';
+		}
+	}
+}
+
+void ScriptProfiler::sample() {
+	if (!callback) {
+		return;
+	}
+	auto now = Clock::now();
+	lua_Debug ar;
+	int depth = 0;
+	while (lua_getstack(L, depth, &ar)) {
+		++depth;
+	}
+	stack = callback;
+	for (int level = depth - 1; level >= 0; --level) {
+		lua_getstack(L, level, &ar);
+		lua_getinfo(L, "Sn", &ar);
+		stack += ';';
+		if (ar.name) {
+			stack += ar.name;
+		}
+		else if (level == depth - 1) {
+			// The callback itself is called from C, so Lua does not know its name
+			stack += callback;
+		}
+		else {
+			stack += *ar.what == 'm' ? "main chunk" : "?";
+		}
+		if (*ar.what != 'C') {
+			stack += " (";
+			stack += ar.short_src;
+			stack += ':';
+			stack += std::to_string(ar.linedefined);
+			stack += ')';
+		}
+	}
+	add(stack, now);
+	last_stack = stack;
+}
+
+void ScriptProfiler::add(const std::string& key, Clock::time_point now) {
+	stacks[key] += std::chrono::duration_cast<std::chrono::microseconds>(now - last_sample).count();
+	last_sample = now;
+}
+
+void ScriptProfiler::hook(lua_State* L, lua_Debug*) {
+	(*static_cast<ScriptProfiler**>(lua_getextraspace(L)))->sample();
+}
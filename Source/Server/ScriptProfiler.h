@@ -0,0 +1,46 @@
+// Copyright 2023 Justus Zorn
+
+#ifndef ANOMALY_SERVER_SCRIPT_PROFILER_H
+#define ANOMALY_SERVER_SCRIPT_PROFILER_H
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+
+#include <lua.hpp>
+
+// Samples the Lua call stack every few instructions and accumulates the time between samples
+// per stack, rooted at the event callback that was running. The totals are written as folded
+// stacks, which flamegraph tools read directly.
+class ScriptProfiler {
+public:
+	ScriptProfiler(lua_State* L, const std::string& path, uint32_t interval);
+	ScriptProfiler(const ScriptProfiler&) = delete;
+	~ScriptProfiler();
+
+	ScriptProfiler& operator=(const ScriptProfiler&) = delete;
+
+	void begin(const char* callback);
+	void end();
+
+	void write();
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	lua_State* L;
+	std::string path;
+	std::unordered_map<std::string, uint64_t> stacks;
+	const char* callback = nullptr;
+	std::string stack;
+	std::string last_stack;
+	Clock::time_point last_sample;
+	Clock::time_point last_write;
+
+	void sample();
+	void add(const std::string& key, Clock::time_point now);
+
+	static void hook(lua_State* L, lua_Debug* ar);
+};
+
+#endif
@@ -1,237 +1,693 @@
 // Copyright 2023 Justus Zorn
 
+#include <algorithm>
 #include <iostream>
+#include <iterator>
 
 #include <Server/ContentManager.h>
 #include <Server/Server.h>
 
-Server::Server(ContentManager& content, uint16_t port) : content{ &content } {
-	clients.resize(MAX_CLIENTS);
+static bool same_appearance(const Sprite& a, const Sprite& b) {
+	return a.is_text == b.is_text && a.id == b.id && a.r == b.r && a.g == b.g && a.b == b.b &&
+		a.text == b.text;
+}
+
+static bool same_position(const Sprite& a, const Sprite& b, uint8_t fraction_bits) {
+	return to_fixed(a.x, fraction_bits) == to_fixed(b.x, fraction_bits) &&
+		to_fixed(a.y, fraction_bits) == to_fixed(b.y, fraction_bits) &&
+		to_fixed(a.scale, fraction_bits) == to_fixed(b.scale, fraction_bits);
+}
+
+static void write_position(std::vector<uint8_t>& buffer, const Sprite& sprite, uint8_t fraction_bits) {
+	size_t offset = buffer.size();
+	buffer.resize(offset + 6);
+	write16(buffer.data() + offset, to_fixed(sprite.x, fraction_bits));
+	write16(buffer.data() + offset + 2, to_fixed(sprite.y, fraction_bits));
+	write16(buffer.data() + offset + 4, to_fixed(sprite.scale, fraction_bits));
+}
 
-	ENetAddress address = { 0 };
-	address.host = ENET_HOST_ANY;
-	address.port = port;
+static void write_varint(std::vector<uint8_t>& buffer, uint32_t i) {
+	size_t offset = buffer.size();
+	buffer.resize(offset + 5);
+	buffer.resize(offset + write_varint(buffer.data() + offset, i));
+}
 
-	host = enet_host_create(&address, MAX_CLIENTS, NET_CHANNELS, 0, 0);
-	if (host == nullptr) {
-		std::cerr << "ERROR: Could not connect to network\n";
+static void write_sprite(std::vector<uint8_t>& buffer, const Sprite& sprite, uint8_t fraction_bits) {
+	// White is the most common text color, so it is left out
+	bool has_color = sprite.is_text && (sprite.r != 255 || sprite.g != 255 || sprite.b != 255);
+	uint32_t flags = (sprite.is_text ? SPRITE_TEXT : 0) | (has_color ? SPRITE_COLOR : 0);
+	write_varint(buffer, sprite.id << SPRITE_FLAG_BITS | flags);
+	write_position(buffer, sprite, fraction_bits);
+	if (has_color) {
+		buffer.push_back(sprite.r);
+		buffer.push_back(sprite.g);
+		buffer.push_back(sprite.b);
 	}
 }
 
+Server::Server(ContentManager& content, Network& network, ThreadPool& pool, uint16_t room,
+	const Config& config) : config{ &config }, content{ &content }, network{ &network },
+	pool{ &pool }, room{ room }, profiler("room " + std::to_string(room + 1)) {
+	clients.resize(config.max_clients);
+	encoder = std::thread(&Server::run_encoder, this);
+}
+
 Server::~Server() {
-	enet_host_destroy(host);
+	// Chunks of the last frame are only queued by the encoder
+	wait_for_encoder();
+	for (uint16_t id : active_clients) {
+		for (PendingInput& input : clients[id]->pending_input) {
+			enet_packet_destroy(input.packet);
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(encoder_mutex);
+		encoder_stop = true;
+	}
+	encoder_wake.notify_all();
+	encoder.join();
 }
 
-void Server::update(Script& script, double dt) {
-	ENetEvent event;
-	while (enet_host_service(host, &event, 0) > 0) {
-		uint16_t peer_id = event.peer->incomingPeerID;
-		switch (event.type) {
-		case ENET_EVENT_TYPE_CONNECT:
-			clients[peer_id].peer = event.peer;
-			break;
-		case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
-		case ENET_EVENT_TYPE_DISCONNECT:
-			script.on_quit(peer_id);
-			clients[peer_id].connected = false;
-			break;
-		case ENET_EVENT_TYPE_RECEIVE:
-			if (clients[peer_id].connected) {
-				client_input(peer_id, event.packet, script);
-			}
-			else {
-				bool has_touch = event.packet->data[0];
-				clients[peer_id].connected = true;
-				clients[peer_id].has_touch = has_touch;
-				content->init_client(*this, peer_id);
-				script.on_join(peer_id, has_touch);
-			}
-			enet_packet_destroy(event.packet);
-			break;
+void Server::service(Script& script, uint32_t timeout) {
+	network->wait(room, timeout);
+	NetworkEvent event;
+	while (network->poll(room, event)) {
+		handle_event(script, event);
+	}
+	for (uint16_t id : active_clients) {
+		if (!clients[id]->pending_input.empty()) {
+			handle_input(id, *clients[id], script);
 		}
 	}
+}
+
+void Server::tick(Script& script, double dt) {
 	script.on_tick(dt);
-	for (Client& client : clients) {
-		if (!client.connected) continue;
-		ENetPacket* packet = create_sprite_packet(client);
-		enet_peer_send(client.peer, SPRITE_CHANNEL, packet);
+	simulation_time += dt;
+	for (uint16_t id : active_clients) {
+		// Only the most recent tick is shown when several ticks happen between two sends
+		Client& client = *clients[id];
+		std::swap(client.sprites, client.frame_sprites);
 		client.sprites.clear();
-		if (client.commands.size() > 0) {
-			packet = create_command_packet(client);
-			enet_peer_send(client.peer, COMMAND_CHANNEL, packet);
-			client.commands.clear();
+	}
+	std::swap(shared_sprites, shared_frame_sprites);
+	shared_sprites.clear();
+}
+
+void Server::send() {
+	// The previous frame has to be out of the back buffers before they can be reused
+	wait_for_encoder();
+	encoding.clear();
+	// Clients interpolate between frames by the simulation time they show
+	uint32_t time = static_cast<uint32_t>(simulation_time * 1000.0);
+	// Sends can be further apart than 1 / send_rate, the window bounds the burst after a pause
+	auto now = std::chrono::steady_clock::now();
+	double content_budget = std::min(std::chrono::duration<double>(now - last_send).count() *
+		config->content_rate * 1024.0, static_cast<double>(CONTENT_WINDOW));
+	last_send = now;
+	for (uint16_t id : active_clients) {
+		Client& client = *clients[id];
+		encoding.push_back({ id, &client });
+		client.sent.time = time;
+		// Changes to retained sprites are rare, they are sent right away instead of being encoded
+		// with the frame
+		if (!client.changed_retained.empty()) {
+			network->send(id, client.generation, RETAINED_CHANNEL,
+				create_retained_packet(client, config->position_bits));
+		}
+		if (!client.manifest.empty()) {
+			network->send(id, client.generation, CONTENT_CHANNEL,
+				create_manifest_packet(ContentPacket::MANIFEST, client.manifest));
+			client.manifest.clear();
 		}
-		if (client.audio_commands.size() > 0) {
-			packet = create_audio_packet(client);
-			enet_peer_send(client.peer, AUDIO_CHANNEL, packet);
-			client.audio_commands.clear();
+		if (!client.transfers.empty()) {
+			send_content(id, client, content_budget);
 		}
+		std::swap(client.sent.sprites, client.frame_sprites);
+		std::swap(client.sent.commands, client.commands);
+		std::swap(client.sent.audio_commands, client.audio_commands);
+		client.frame_sprites.clear();
+		client.commands.clear();
+		client.audio_commands.clear();
+	}
+	if (!shared_manifest.empty()) {
+		network->broadcast(room, CONTENT_CHANNEL, create_manifest_packet(ContentPacket::MANIFEST,
+			shared_manifest));
+		shared_manifest.clear();
+	}
+	shared_sent.time = time;
+	std::swap(shared_sent.sprites, shared_frame_sprites);
+	std::swap(shared_sent.audio_commands, shared_audio_commands);
+	shared_frame_sprites.clear();
+	shared_audio_commands.clear();
+	{
+		std::lock_guard<std::mutex> lock(encoder_mutex);
+		encoder_busy = true;
 	}
+	encoder_wake.notify_all();
 }
 
-void Server::update_client_content(uint16_t client, ContentType type, uint32_t id, const std::vector<uint8_t>& data) {
-	ENetPacket* packet = create_content_packet(type, id, data);
-	enet_peer_send(clients[client].peer, CONTENT_CHANNEL, packet);
+bool Server::has_clients() const {
+	return !active_clients.empty();
 }
 
-void Server::update_content(ContentType type, uint32_t id, const std::vector<uint8_t>& data) {
-	ENetPacket* packet = create_content_packet(type, id, data);
-	enet_host_broadcast(host, CONTENT_CHANNEL, packet);
+Profiler& Server::get_profiler() {
+	return profiler;
+}
+
+void Server::run_encoder() {
+	std::unique_lock<std::mutex> lock(encoder_mutex);
+	while (true) {
+		encoder_wake.wait(lock, [this] { return encoder_busy || encoder_stop; });
+		if (encoder_stop) {
+			return;
+		}
+		lock.unlock();
+		encode_frame();
+		lock.lock();
+		encoder_busy = false;
+		encoder_wake.notify_all();
+	}
+}
+
+void Server::wait_for_encoder() {
+	std::unique_lock<std::mutex> lock(encoder_mutex);
+	encoder_wake.wait(lock, [this] { return !encoder_busy; });
+}
+
+void Server::encode_frame() {
+	encoded.resize(encoding.size());
+	{
+		// Every client only reads its own frame, so they can all be encoded at the same time
+		ProfileScope scope(profiler, Phase::ENCODE);
+		encode_shared();
+		pool->parallel_for(encoding.size(), [this](size_t i) {
+			Client& client = *encoding[i].client;
+			const Frame& frame = client.sent;
+			encoded[i].sprites = create_sprite_packet(client.layer, client.sent,
+				client.acked_frame.load(), config->position_bits);
+			encoded[i].commands = nullptr;
+			encoded[i].audio = nullptr;
+			if (frame.commands.size() > 0) {
+				encoded[i].commands = create_command_packet(frame);
+			}
+			if (frame.audio_commands.size() > 0) {
+				encoded[i].audio = create_audio_packet(frame);
+			}
+		});
+	}
+	ProfileScope scope(profiler, Phase::SEND);
+	// The same packets go to every client of the room, ENet only keeps one reference per client
+	if (shared_encoded.sprites != nullptr) {
+		network->broadcast(room, SHARED_CHANNEL, shared_encoded.sprites);
+	}
+	if (shared_encoded.audio != nullptr) {
+		network->broadcast(room, AUDIO_CHANNEL, shared_encoded.audio);
+	}
+	for (size_t i = 0; i < encoding.size(); ++i) {
+		uint16_t id = encoding[i].id;
+		uint32_t generation = encoding[i].client->generation;
+		network->send(id, generation, SPRITE_CHANNEL, encoded[i].sprites);
+		if (encoded[i].commands != nullptr) {
+			network->send(id, generation, COMMAND_CHANNEL, encoded[i].commands);
+		}
+		if (encoded[i].audio != nullptr) {
+			network->send(id, generation, AUDIO_CHANNEL, encoded[i].audio);
+		}
+		for (ENetPacket* chunk : encoding[i].client->sent.chunks) {
+			network->send(id, generation, CONTENT_CHANNEL, chunk);
+		}
+		encoding[i].client->sent.chunks.clear();
+	}
+}
+
+void Server::encode_shared() {
+	shared_encoded = { nullptr, nullptr, nullptr };
+	if (encoding.empty()) {
+		return;
+	}
+	// A delta has to be decodable by every client, so it is encoded against the newest frame all
+	// of them hold. Bit i of common stands for the frame i before the newest one sent.
+	uint32_t newest = shared_layer.frame_number;
+	uint32_t common = UINT32_MAX;
+	for (const EncodingClient& encoding_client : encoding) {
+		uint64_t acked = encoding_client.client->acked_shared.load();
+		uint32_t frame = static_cast<uint32_t>(acked >> 32);
+		uint32_t held = static_cast<uint32_t>(acked) | 1;
+		if (frame == 0 || frame > newest || newest - frame >= 32) {
+			common = 0;
+			break;
+		}
+		common &= held << (newest - frame);
+	}
+	uint32_t baseline = 0;
+	if (common != 0) {
+		uint32_t age = 0;
+		while (!(common & (1u << age))) {
+			++age;
+		}
+		baseline = newest - age;
+	}
+	// Games that do not use the shared layer only pay for it until every client has seen it empty
+	const Snapshot& previous = shared_layer.history[shared_layer.frame_number % SPRITE_HISTORY];
+	if (!shared_sent.sprites.empty() || !previous.sprites.empty() ||
+		baseline < shared_layer.frame_number) {
+		shared_encoded.sprites = create_sprite_packet(shared_layer, shared_sent, baseline,
+			config->position_bits);
+	}
+	if (!shared_sent.audio_commands.empty()) {
+		shared_encoded.audio = create_audio_packet(shared_sent);
+	}
+}
+
+void Server::update_manifest(const std::vector<ContentEntry>& entries) {
+	// Clients ignore updates for content they have never been told about
+	network->broadcast(CONTENT_CHANNEL, create_manifest_packet(ContentPacket::UPDATE, entries));
 }
 
 bool Server::start_text_input(uint16_t client) {
-	if (client >= clients.size() || !clients[client].connected) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
 		return false;
 	}
-	clients[client].commands.push_back({ Command::Type::START_TEXT_INPUT });
+	player->commands.push_back({ Command::Type::START_TEXT_INPUT });
 	return true;
 }
 
 bool Server::stop_text_input(uint16_t client) {
-	if (client >= clients.size() || !clients[client].connected) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
 		return false;
 	}
-	clients[client].commands.push_back({ Command::Type::STOP_TEXT_INPUT });
+	player->commands.push_back({ Command::Type::STOP_TEXT_INPUT });
 	return true;
 }
 
 const char* Server::get_composition(uint16_t client) {
-	if (client >= clients.size() || !clients[client].connected) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
 		return nullptr;
 	}
-	return clients[client].composition.c_str();
+	return player->composition.c_str();
+}
+
+bool Server::get_net_stats(uint16_t client, ClientStats& stats) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
+		return false;
+	}
+	return network->get_stats(client, player->generation, stats);
+}
+
+float Server::get_sprite_width(uint32_t id) {
+	return content->get_image_aspect_ratio(id);
 }
 
-float Server::get_sprite_width(const std::string& path) {
-	return content->get_image_aspect_ratio(path);
+uint32_t Server::get_content_id(ContentType type, std::string_view path) const {
+	return content->get_id(type, path);
 }
 
-int Server::draw_sprite(uint16_t client, const std::string& path, float x, float y, float scale) {
-	if (client >= clients.size() || !clients[client].connected) {
+bool Server::has_content_id(ContentType type, uint32_t id) const {
+	return content->has_id(type, id);
+}
+
+bool Server::draw_sprite(uint16_t client, uint32_t id, float x, float y, float scale) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
+		return false;
+	}
+	announce(*player, ContentType::IMAGE, id);
+	player->sprites.push_back({ false, id, x, y, scale, 0, 0, 0, "" });
+	return true;
+}
+
+bool Server::draw_text(uint16_t client, uint32_t id, float x, float y, float scale, uint8_t r,
+	uint8_t g, uint8_t b, std::string text) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
+		return false;
+	}
+	announce(*player, ContentType::FONT, id);
+	player->sprites.push_back({ true, id, x, y, scale, r, g, b, text });
+	return true;
+}
+
+bool Server::draw_sprites(uint16_t client, std::vector<Sprite>& sprites) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
+		return false;
+	}
+	for (const Sprite& sprite : sprites) {
+		announce(*player, sprite.is_text ? ContentType::FONT : ContentType::IMAGE, sprite.id);
+	}
+	player->sprites.insert(player->sprites.end(), std::make_move_iterator(sprites.begin()),
+		std::make_move_iterator(sprites.end()));
+	return true;
+}
+
+int Server::create_sprite(uint16_t client, uint32_t id, float x, float y, float scale,
+	uint32_t& handle) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
 		return 1;
 	}
-	uint32_t id = content->get_image_id(path);
-	if (id == 0) {
+	announce(*player, ContentType::IMAGE, id);
+	if (!player->free_retained.empty()) {
+		handle = player->free_retained.back();
+		player->free_retained.pop_back();
+	}
+	else if (player->retained.size() < MAX_RETAINED_SPRITES) {
+		player->retained.push_back({ 0, 0.0f, 0.0f, 0.0f, false, 0 });
+		handle = static_cast<uint32_t>(player->retained.size());
+	}
+	else {
 		return 2;
 	}
-	clients[client].sprites.push_back({ false, id, x, y, scale, 0, 0, 0, "" });
+	RetainedSprite& sprite = player->retained[handle - 1];
+	sprite.id = id;
+	sprite.x = x;
+	sprite.y = y;
+	sprite.scale = scale;
+	sprite.visible = true;
+	change_retained(*player, handle, RETAINED_CREATED);
 	return 0;
 }
 
-int Server::draw_text(uint16_t client, const std::string& path, float x, float y, float scale,
-	uint8_t r, uint8_t g, uint8_t b, std::string text) {
-	if (client >= clients.size() || !clients[client].connected) {
+int Server::set_sprite_position(uint16_t client, uint32_t handle, float x, float y, float scale) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
 		return 1;
 	}
-	uint32_t id = content->get_font_id(path);
-	if (id == 0) {
+	RetainedSprite* sprite = find_retained(*player, handle);
+	if (sprite == nullptr) {
 		return 2;
 	}
-	clients[client].sprites.push_back({ true, id, x, y, scale, r, g, b, text });
+	if (sprite->x != x || sprite->y != y || sprite->scale != scale) {
+		sprite->x = x;
+		sprite->y = y;
+		sprite->scale = scale;
+		change_retained(*player, handle, RETAINED_MOVED);
+	}
 	return 0;
 }
 
-bool Server::kick(uint16_t client) {
-	if (client >= clients.size() || !clients[client].connected) {
-		return false;
+int Server::set_sprite_visible(uint16_t client, uint32_t handle, bool visible) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
+		return 1;
 	}
-	enet_peer_disconnect(clients[client].peer, 0);
-	return true;
+	RetainedSprite* sprite = find_retained(*player, handle);
+	if (sprite == nullptr) {
+		return 2;
+	}
+	if (sprite->visible != visible) {
+		sprite->visible = visible;
+		change_retained(*player, handle, RETAINED_SHOWN);
+	}
+	return 0;
 }
 
-int Server::play(uint16_t client, const std::string& path, uint16_t channel, uint8_t volume) {
-	if (client >= clients.size() || !clients[client].connected) {
+int Server::destroy_sprite(uint16_t client, uint32_t handle) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
 		return 1;
 	}
-	uint32_t id = content->get_sound_id(path);
-	if (id == 0) {
+	RetainedSprite* sprite = find_retained(*player, handle);
+	if (sprite == nullptr) {
 		return 2;
 	}
-	clients[client].audio_commands.push_back({ id, channel, volume, AudioCommand::Type::PLAY });
+	// Nothing but the destruction is sent, unless the handle is reused before the next frame
+	sprite->id = 0;
+	change_retained(*player, handle, RETAINED_DESTROYED);
+	player->free_retained.push_back(handle);
 	return 0;
 }
 
-int Server::play_any(uint16_t client, const std::string& path, uint8_t volume) {
-	if (client >= clients.size() || !clients[client].connected) {
+void Server::draw_shared_sprite(uint32_t id, float x, float y, float scale) {
+	announce_shared(ContentType::IMAGE, id);
+	shared_sprites.push_back({ false, id, x, y, scale, 0, 0, 0, "" });
+}
+
+void Server::draw_shared_text(uint32_t id, float x, float y, float scale, uint8_t r, uint8_t g,
+	uint8_t b, std::string text) {
+	announce_shared(ContentType::FONT, id);
+	shared_sprites.push_back({ true, id, x, y, scale, r, g, b, text });
+}
+
+int Server::preload(uint16_t client, const std::string& path) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
 		return 1;
 	}
-	uint32_t id = content->get_sound_id(path);
-	if (id == 0) {
+	// The same path may name an image, a font and a sound
+	uint32_t image = content->get_id(ContentType::IMAGE, path);
+	uint32_t font = content->get_id(ContentType::FONT, path);
+	uint32_t sound = content->get_id(ContentType::SOUND, path);
+	if (image == 0 && font == 0 && sound == 0) {
 		return 2;
 	}
-	clients[client].audio_commands.push_back({ id, 0, volume, AudioCommand::Type::PLAY_ANY });
+	if (image != 0) {
+		announce(*player, ContentType::IMAGE, image);
+	}
+	if (font != 0) {
+		announce(*player, ContentType::FONT, font);
+	}
+	if (sound != 0) {
+		announce(*player, ContentType::SOUND, sound);
+	}
 	return 0;
 }
 
+bool Server::kick(uint16_t client) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
+		return false;
+	}
+	network->disconnect(client, player->generation);
+	return true;
+}
+
+bool Server::play(uint16_t client, uint32_t id, uint16_t channel, uint8_t volume) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
+		return false;
+	}
+	announce(*player, ContentType::SOUND, id);
+	player->audio_commands.push_back({ id, channel, volume, AudioCommand::Type::PLAY });
+	return true;
+}
+
+bool Server::play_any(uint16_t client, uint32_t id, uint8_t volume) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
+		return false;
+	}
+	announce(*player, ContentType::SOUND, id);
+	player->audio_commands.push_back({ id, 0, volume, AudioCommand::Type::PLAY_ANY });
+	return true;
+}
+
 bool Server::stop(uint16_t client, uint16_t channel) {
-	if (client >= clients.size() || !clients[client].connected) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
 		return false;
 	}
-	clients[client].audio_commands.push_back({ 0, channel, 0, AudioCommand::Type::STOP });
+	player->audio_commands.push_back({ 0, channel, 0, AudioCommand::Type::STOP });
 	return true;
 }
 
 bool Server::stop_all(uint16_t client) {
-	if (client >= clients.size() || !clients[client].connected) {
+	Client* player = find_client(client);
+	if (player == nullptr) {
 		return false;
 	}
-	clients[client].audio_commands.push_back({ 0, 0, 0, AudioCommand::Type::STOP_ALL });
+	player->audio_commands.push_back({ 0, 0, 0, AudioCommand::Type::STOP_ALL });
 	return true;
 }
 
-ENetPacket* Server::create_sprite_packet(Client& client) {
-	uint32_t size = 4;
-	for (const Sprite& sprite : client.sprites) {
-		if (sprite.is_text) {
-			size += 23;
-			size += sprite.text.length();
+void Server::play_shared(uint32_t id, uint16_t channel, uint8_t volume) {
+	announce_shared(ContentType::SOUND, id);
+	shared_audio_commands.push_back({ id, channel, volume, AudioCommand::Type::PLAY });
+}
+
+void Server::play_any_shared(uint32_t id, uint8_t volume) {
+	announce_shared(ContentType::SOUND, id);
+	shared_audio_commands.push_back({ id, 0, volume, AudioCommand::Type::PLAY_ANY });
+}
+
+ENetPacket* Server::create_sprite_packet(Layer& layer, Frame& frame, uint32_t baseline,
+	uint8_t fraction_bits) {
+	std::vector<Sprite>& sprites = frame.sprites;
+	uint32_t number = ++layer.frame_number;
+	// Deltas are only encoded against a frame the client is known to have, if the
+	// acknowledgements stop coming in the client gets a full frame again
+	if (baseline == 0 || number - baseline >= SPRITE_HISTORY ||
+		layer.history[baseline % SPRITE_HISTORY].number != baseline) {
+		baseline = 0;
+	}
+	static const std::vector<Sprite> empty;
+	const std::vector<Sprite>& base = baseline != 0 ?
+		layer.history[baseline % SPRITE_HISTORY].sprites : empty;
+	if (baseline > layer.confirmed_frame) {
+		// Strings defined in a frame the client received can be referenced by their slot now,
+		// unless the slot has been given to another string since
+		for (auto [slot, generation] : layer.history[baseline % SPRITE_HISTORY].defined) {
+			if (layer.strings[slot].generation == generation) {
+				layer.strings[slot].confirmed = true;
+			}
 		}
-		else {
-			size += 16;
+		layer.confirmed_frame = baseline;
+	}
+	Snapshot& snapshot = layer.history[number % SPRITE_HISTORY];
+	snapshot.number = number;
+	snapshot.defined.clear();
+
+	std::vector<uint8_t>& buffer = layer.buffer;
+	buffer.resize(13);
+	write32(buffer.data(), number);
+	write32(buffer.data() + 4, baseline);
+	write32(buffer.data() + 8, frame.time);
+	buffer[12] = fraction_bits;
+	write_varint(buffer, static_cast<uint32_t>(sprites.size()));
+	size_t op = 0;
+	SpriteDelta current = SpriteDelta::UNCHANGED;
+	uint8_t run = 0;
+	for (size_t i = 0; i < sprites.size(); ++i) {
+		const Sprite& sprite = sprites[i];
+		SpriteDelta delta = SpriteDelta::REPLACED;
+		if (i < base.size() && same_appearance(sprite, base[i])) {
+			delta = same_position(sprite, base[i], fraction_bits) ? SpriteDelta::UNCHANGED : SpriteDelta::MOVED;
+		}
+		if (run == 0 || delta != current || run == SPRITE_DELTA_RUN) {
+			op = buffer.size();
+			buffer.push_back(0);
+			current = delta;
+			run = 0;
+		}
+		++run;
+		buffer[op] = static_cast<uint8_t>(static_cast<uint8_t>(current) << 6 | (run - 1));
+		if (delta == SpriteDelta::MOVED) {
+			write_position(buffer, sprite, fraction_bits);
+		}
+		else if (delta == SpriteDelta::REPLACED) {
+			write_sprite(buffer, sprite, fraction_bits);
+			if (sprite.is_text) {
+				write_string(layer, snapshot, sprite.text);
+			}
 		}
 	}
-	ENetPacket* packet = enet_packet_create(nullptr, size, 0);
-	write32(packet->data, static_cast<uint32_t>(client.sprites.size()));
-	uint8_t* data = packet->data + 4;
-	for (const Sprite& sprite : client.sprites) {
-		write_float(data + 4, sprite.x);
-		write_float(data + 8, sprite.y);
-		write_float(data + 12, sprite.scale);
-		if (sprite.is_text) {
-			write32(data, sprite.id | 0x80000000);
-			data[16] = sprite.r;
-			data[17] = sprite.g;
-			data[18] = sprite.b;
-			write32(data + 19, static_cast<uint32_t>(sprite.text.length()));
-			memcpy(data + 23, sprite.text.data(), sprite.text.length());
-			data += 23;
-			data += sprite.text.length();
+
+	// The sent sprites become the baseline for later frames, the old baseline's buffer is
+	// reused for the next frame
+	std::swap(snapshot.sprites, sprites);
+	return enet_packet_create(buffer.data(), buffer.size(), 0);
+}
+
+void Server::write_string(Layer& layer, Snapshot& snapshot, const std::string& text) {
+	// Strings are referenced as (slot << 1 | has_definition), a definition is sent with every
+	// use until a frame containing it is acknowledged
+	uint32_t number = snapshot.number;
+	std::vector<uint8_t>& buffer = layer.buffer;
+	uint16_t slot = 0;
+	if (!layer.strings.empty() && text.length() <= STRING_TABLE_MAX_LENGTH) {
+		auto it = layer.string_slots.find(text);
+		if (it != layer.string_slots.end()) {
+			slot = it->second;
 		}
 		else {
-			write32(data, sprite.id);
-			data += 16;
+			// Take an unused slot, or the least recently used one that is not part of this frame
+			uint32_t oldest = number;
+			for (uint16_t i = 1; i < layer.strings.size(); ++i) {
+				if (layer.strings[i].last_used < oldest) {
+					oldest = layer.strings[i].last_used;
+					slot = i;
+					if (oldest == 0) {
+						break;
+					}
+				}
+			}
+			if (slot != 0) {
+				StringSlot& entry = layer.strings[slot];
+				if (entry.last_used != 0) {
+					layer.string_slots.erase(entry.text);
+				}
+				entry.text = text;
+				++entry.generation;
+				entry.defined_in = 0;
+				entry.confirmed = false;
+				layer.string_slots[text] = slot;
+			}
 		}
 	}
-	return packet;
+	if (slot == 0) {
+		write_varint(buffer, 1);
+	}
+	else {
+		StringSlot& entry = layer.strings[slot];
+		entry.last_used = number;
+		if (entry.confirmed || entry.defined_in == number) {
+			write_varint(buffer, static_cast<uint32_t>(slot) << 1);
+			return;
+		}
+		entry.defined_in = number;
+		snapshot.defined.emplace_back(slot, entry.generation);
+		write_varint(buffer, static_cast<uint32_t>(slot) << 1 | 1);
+	}
+	write_varint(buffer, static_cast<uint32_t>(text.length()));
+	buffer.insert(buffer.end(), text.begin(), text.end());
 }
 
-ENetPacket* Server::create_command_packet(Client& client) {
-	uint32_t size = 4 + client.commands.size();
+ENetPacket* Server::create_retained_packet(Client& client, uint8_t fraction_bits) {
+	std::vector<uint8_t> buffer;
+	buffer.push_back(fraction_bits);
+	for (uint32_t handle : client.changed_retained) {
+		RetainedSprite& sprite = client.retained[handle - 1];
+		if (sprite.id == 0) {
+			write_varint(buffer, handle << RETAINED_OP_BITS | static_cast<uint32_t>(RetainedOp::DESTROY));
+		}
+		else if (sprite.changes & RETAINED_CREATED) {
+			write_varint(buffer, handle << RETAINED_OP_BITS | static_cast<uint32_t>(RetainedOp::CREATE));
+			write_varint(buffer, sprite.id);
+		}
+		if (sprite.id != 0 && sprite.changes & (RETAINED_CREATED | RETAINED_MOVED)) {
+			if (!(sprite.changes & RETAINED_CREATED)) {
+				write_varint(buffer, handle << RETAINED_OP_BITS | static_cast<uint32_t>(RetainedOp::POSITION));
+			}
+			size_t offset = buffer.size();
+			buffer.resize(offset + 6);
+			write16(buffer.data() + offset, to_fixed(sprite.x, fraction_bits));
+			write16(buffer.data() + offset + 2, to_fixed(sprite.y, fraction_bits));
+			write16(buffer.data() + offset + 4, to_fixed(sprite.scale, fraction_bits));
+		}
+		if (sprite.id != 0 && sprite.changes & (RETAINED_CREATED | RETAINED_SHOWN)) {
+			if (!(sprite.changes & RETAINED_CREATED)) {
+				write_varint(buffer, handle << RETAINED_OP_BITS | static_cast<uint32_t>(RetainedOp::VISIBILITY));
+			}
+			buffer.push_back(sprite.visible);
+		}
+		sprite.changes = 0;
+	}
+	client.changed_retained.clear();
+	return enet_packet_create(buffer.data(), buffer.size(), ENET_PACKET_FLAG_RELIABLE);
+}
+
+ENetPacket* Server::create_command_packet(const Frame& frame) {
+	uint32_t size = 4 + frame.commands.size();
 	ENetPacket* packet = enet_packet_create(nullptr, size, 0);
-	write32(packet->data, static_cast<uint32_t>(client.commands.size()));
+	write32(packet->data, static_cast<uint32_t>(frame.commands.size()));
 	uint8_t* data = packet->data + 4;
-	for (const Command& command : client.commands) {
+	for (const Command& command : frame.commands) {
 		*(data++) = static_cast<uint8_t>(command.type);
 	}
 	return packet;
 }
 
-ENetPacket* Server::create_audio_packet(Client& client) {
-	uint32_t size = 4 + 8 * client.audio_commands.size();
+ENetPacket* Server::create_audio_packet(const Frame& frame) {
+	uint32_t size = 4 + 8 * frame.audio_commands.size();
 	ENetPacket* packet = enet_packet_create(nullptr, size, 0);
-	write32(packet->data, static_cast<uint32_t>(client.audio_commands.size()));
+	write32(packet->data, static_cast<uint32_t>(frame.audio_commands.size()));
 	uint8_t* data = packet->data + 4;
-	for (const AudioCommand& audio_command : client.audio_commands) {
+	for (const AudioCommand& audio_command : frame.audio_commands) {
 		write32(data, audio_command.id);
 		write16(data + 4, audio_command.channel);
 		data[6] = audio_command.volume;
@@ -241,17 +697,281 @@ ENetPacket* Server::create_audio_packet(Client& client) {
 	return packet;
 }
 
-ENetPacket* Server::create_content_packet(ContentType type, uint32_t id, const std::vector<uint8_t>& data) {
-	ENetPacket* packet = enet_packet_create(nullptr, 9 + data.size(), ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_UNSEQUENCED);
+ENetPacket* Server::create_manifest_packet(ContentPacket type,
+	const std::vector<ContentEntry>& entries) {
+	ENetPacket* packet = enet_packet_create(nullptr, 5 + MANIFEST_ENTRY_SIZE * entries.size(),
+		ENET_PACKET_FLAG_RELIABLE);
 	packet->data[0] = static_cast<uint8_t>(type);
-	write32(packet->data + 1, id);
-	write32(packet->data + 5, data.size());
-	memcpy(packet->data + 9, data.data(), data.size());
+	write32(packet->data + 1, static_cast<uint32_t>(entries.size()));
+	uint8_t* data = packet->data + 5;
+	for (const ContentEntry& entry : entries) {
+		data[0] = static_cast<uint8_t>(entry.type);
+		write32(data + 1, entry.id);
+		write64(data + 5, entry.hash);
+		write32(data + 13, entry.size);
+		data += MANIFEST_ENTRY_SIZE;
+	}
+	return packet;
+}
+
+ENetPacket* Server::create_chunk_packet(uint64_t hash, uint32_t size, uint32_t offset,
+	const std::vector<uint8_t>& chunk) {
+	ENetPacket* packet = enet_packet_create(nullptr, 17 + chunk.size(), ENET_PACKET_FLAG_RELIABLE);
+	packet->data[0] = static_cast<uint8_t>(ContentPacket::CHUNK);
+	write64(packet->data + 1, hash);
+	write32(packet->data + 9, size);
+	write32(packet->data + 13, offset);
+	memcpy(packet->data + 17, chunk.data(), chunk.size());
 	return packet;
 }
 
-void Server::client_input(uint16_t client, ENetPacket* input_packet, Script& script) {
-	uint8_t* data = input_packet->data;
+Server::Client* Server::find_client(uint16_t client) {
+	if (client >= clients.size()) {
+		return nullptr;
+	}
+	return clients[client].get();
+}
+
+Server::RetainedSprite* Server::find_retained(Client& client, uint32_t handle) {
+	if (handle == 0 || handle > client.retained.size() || client.retained[handle - 1].id == 0) {
+		return nullptr;
+	}
+	return &client.retained[handle - 1];
+}
+
+void Server::change_retained(Client& client, uint32_t handle, uint8_t change) {
+	RetainedSprite& sprite = client.retained[handle - 1];
+	if (sprite.changes == 0) {
+		client.changed_retained.push_back(handle);
+	}
+	sprite.changes |= change;
+}
+
+bool Server::mark_announced(std::vector<bool>& announced, uint32_t id) {
+	if (id < announced.size() && announced[id]) {
+		return false;
+	}
+	if (id >= announced.size()) {
+		announced.resize(id + 1);
+	}
+	announced[id] = true;
+	return true;
+}
+
+void Server::announce(Client& client, ContentType type, uint32_t id) {
+	if (!mark_announced(client.announced[static_cast<size_t>(type)], id)) {
+		return;
+	}
+	ContentEntry entry;
+	if (content->get_entry(type, id, entry)) {
+		client.manifest.push_back(entry);
+	}
+}
+
+void Server::announce_shared(ContentType type, uint32_t id) {
+	if (!mark_announced(shared_announced[static_cast<size_t>(type)], id)) {
+		return;
+	}
+	ContentEntry entry;
+	if (content->get_entry(type, id, entry)) {
+		shared_manifest.push_back(entry);
+	}
+}
+
+void Server::request_content(Client& client, ENetPacket* request) {
+	// [count] followed by the requested hashes and the offsets to start at
+	if (request->dataLength < 4) {
+		return;
+	}
+	uint32_t count = read32(request->data);
+	if (request->dataLength < 4 + 12 * static_cast<size_t>(count)) {
+		return;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		uint64_t hash = read64(request->data + 4 + 12 * i);
+		uint32_t offset = read32(request->data + 12 + 12 * i);
+		// Every blob is queued at most once, so a client can not queue more transfers than
+		// there are blobs, no matter how often it asks
+		if (!content->has_blob(hash)) {
+			continue;
+		}
+		bool queued = false;
+		for (Transfer& transfer : client.transfers) {
+			if (transfer.hash == hash) {
+				queued = true;
+				break;
+			}
+		}
+		if (!queued) {
+			client.transfers.push_back({ hash, offset });
+		}
+	}
+}
+
+void Server::send_content(uint16_t id, Client& client, double budget) {
+	// Chunks are queued by the encoder after the frame packets and only within a budget per
+	// send, so that downloads never hold up the game
+	if (network->get_content_in_flight(id) > CONTENT_WINDOW) {
+		return;
+	}
+	while (budget > 0.0 && !client.transfers.empty()) {
+		Transfer& transfer = client.transfers.front();
+		uint32_t size;
+		if (!content->read_chunk(transfer.hash, transfer.offset, content_chunk, size)) {
+			client.transfers.pop_front();
+			continue;
+		}
+		client.sent.chunks.push_back(create_chunk_packet(transfer.hash, size, transfer.offset,
+			content_chunk));
+		transfer.offset += static_cast<uint32_t>(content_chunk.size());
+		budget -= static_cast<double>(content_chunk.size());
+		// Transfers take turns, so that small files are not stuck behind a large one
+		Transfer next = transfer;
+		client.transfers.pop_front();
+		if (next.offset < size) {
+			client.transfers.push_back(next);
+		}
+	}
+}
+
+void Server::add_client(uint16_t client, uint32_t generation, bool has_touch) {
+	std::unique_ptr<Client> player;
+	if (!free_clients.empty()) {
+		// Reuse a previous player's buffers, they keep their capacity. The encoder might still
+		// be encoding the previous player's last frame.
+		wait_for_encoder();
+		player = std::move(free_clients.back());
+		free_clients.pop_back();
+		for (Snapshot& snapshot : player->layer.history) {
+			snapshot.number = 0;
+		}
+		player->layer.strings.clear();
+		player->layer.string_slots.clear();
+	}
+	else {
+		player = std::make_unique<Client>();
+		player->sprites.reserve(INITIAL_SPRITE_CAPACITY);
+		player->frame_sprites.reserve(INITIAL_SPRITE_CAPACITY);
+	}
+	player->generation = generation;
+	player->has_touch = has_touch;
+	player->active_index = active_clients.size();
+	player->sprites.clear();
+	player->frame_sprites.clear();
+	player->commands.clear();
+	player->audio_commands.clear();
+	player->retained.clear();
+	player->free_retained.clear();
+	player->changed_retained.clear();
+	player->layer.frame_number = 0;
+	player->layer.strings.resize(STRING_TABLE_SIZE + 1);
+	player->layer.confirmed_frame = 0;
+	player->acked_frame = 0;
+	player->acked_shared = 0;
+	player->motion_sequence = 0;
+	player->manifest.clear();
+	player->transfers.clear();
+	// Content of the shared layer is announced right away, anything else once it is used
+	for (size_t type = 0; type < CONTENT_TYPES; ++type) {
+		player->announced[type] = shared_announced[type];
+		for (uint32_t id = 0; id < shared_announced[type].size(); ++id) {
+			ContentEntry entry;
+			if (shared_announced[type][id] &&
+				content->get_entry(static_cast<ContentType>(type), id, entry)) {
+				player->manifest.push_back(entry);
+			}
+		}
+	}
+	player->composition.clear();
+	active_clients.push_back(client);
+	clients[client] = std::move(player);
+}
+
+void Server::remove_client(uint16_t client) {
+	for (PendingInput& input : clients[client]->pending_input) {
+		enet_packet_destroy(input.packet);
+	}
+	clients[client]->pending_input.clear();
+	size_t index = clients[client]->active_index;
+	active_clients[index] = active_clients.back();
+	clients[active_clients[index]]->active_index = index;
+	active_clients.pop_back();
+	// The encoder might still be reading the last frame, so the client is never destroyed
+	free_clients.push_back(std::move(clients[client]));
+}
+
+void Server::handle_event(Script& script, NetworkEvent& event) {
+	switch (event.type) {
+	case NetworkEvent::Type::CONNECT:
+		break;
+	case NetworkEvent::Type::DISCONNECT:
+		if (find_client(event.client) != nullptr) {
+			script.on_quit(event.client);
+			remove_client(event.client);
+		}
+		break;
+	case NetworkEvent::Type::RECEIVE:
+		if (Client* player = find_client(event.client)) {
+			if (event.channel == ACK_CHANNEL) {
+				// [frame][shared frame][received shared frames before it]
+				if (event.packet->dataLength >= 12) {
+					uint32_t frame = read32(event.packet->data);
+					if (frame > player->acked_frame.load()) {
+						player->acked_frame = frame;
+					}
+					uint32_t shared_frame = read32(event.packet->data + 4);
+					if (shared_frame >= player->acked_shared.load() >> 32) {
+						player->acked_shared = static_cast<uint64_t>(shared_frame) << 32 |
+							read32(event.packet->data + 8);
+					}
+				}
+			}
+			else if (event.channel == MOTION_CHANNEL) {
+				client_motion(event.client, *player, event.packet, script);
+				handle_input(event.client, *player, script);
+			}
+			else if (event.channel == CONTENT_CHANNEL) {
+				request_content(*player, event.packet);
+			}
+			else if (event.channel == INPUT_CHANNEL && event.packet->dataLength >= 16) {
+				// Kept until the motion sampled before it has been handled
+				player->pending_input.push_back({ event.packet,
+					enet_time_get() + INPUT_ORDER_TIMEOUT });
+				handle_input(event.client, *player, script);
+				break;
+			}
+		}
+		else if (event.channel == INPUT_CHANNEL) {
+			bool has_touch = event.packet->data[0];
+			add_client(event.client, event.generation, has_touch);
+			script.on_join(event.client, has_touch);
+		}
+		enet_packet_destroy(event.packet);
+		break;
+	}
+}
+
+void Server::handle_input(uint16_t client, Client& player, Script& script) {
+	while (!player.pending_input.empty()) {
+		PendingInput& input = player.pending_input.front();
+		uint32_t sequence = read32(input.packet->data);
+		if (sequence > player.motion_sequence) {
+			if (static_cast<int32_t>(enet_time_get() - input.deadline) < 0) {
+				return;
+			}
+			// The motion got lost, if it still arrives it is older than the events
+			player.motion_sequence = sequence;
+		}
+		client_input(client, player, input.packet, script);
+		enet_packet_destroy(input.packet);
+		player.pending_input.pop_front();
+	}
+}
+
+void Server::client_input(uint16_t client, Client& player, ENetPacket* input_packet, Script& script) {
+	ProfileScope scope(profiler, Phase::INPUT);
+	// [newest motion sample before the events], then the keys, the composition and the buttons
+	uint8_t* data = input_packet->data + 4;
 	uint32_t length = read32(data);
 	data += 4;
 	for (uint32_t i = 0; i < length; ++i) {
@@ -265,7 +985,7 @@ void Server::client_input(uint16_t client, ENetPacket* input_packet, Script& scr
 	}
 	length = read32(data);
 	data += 4;
-	clients[client].composition.assign(reinterpret_cast<const char*>(data), length);
+	player.composition.assign(reinterpret_cast<const char*>(data), length);
 	data += length;
 	length = read32(data);
 	data += 4;
@@ -275,7 +995,7 @@ void Server::client_input(uint16_t client, ENetPacket* input_packet, Script& scr
 		uint8_t button = data[8];
 		uint8_t type = data[9];
 		data += 10;
-		if (clients[client].has_touch) {
+		if (player.has_touch) {
 			if (button == 3 && type == static_cast<uint8_t>(InputEventType::DOWN)) {
 				script.request_reload();
 			}
@@ -291,9 +1011,50 @@ void Server::client_input(uint16_t client, ENetPacket* input_packet, Script& scr
 			}
 		}
 	}
-	float wheel_x = read_float(data);
-	float wheel_y = read_float(data + 4);
-	if (wheel_x != 0.0f || wheel_y != 0.0f) {
-		script.on_mouse_wheel(client, wheel_x, wheel_y);
+}
+
+void Server::client_motion(uint16_t client, Client& player, ENetPacket* motion_packet, Script& script) {
+	// Every sample is repeated in several packets, only those not seen before are handled
+	uint8_t* data = motion_packet->data;
+	uint8_t* end = data + motion_packet->dataLength;
+	if (end - data < 5) {
+		return;
+	}
+	uint32_t sequence = read32(data);
+	uint8_t count = data[4];
+	data += 5;
+	for (uint8_t i = 0; i < count; ++i, ++sequence) {
+		if (end - data < 9 || end - data < 9 + 9 * data[8]) {
+			return;
+		}
+		float wheel_x = read_float(data);
+		float wheel_y = read_float(data + 4);
+		uint8_t pointers = data[8];
+		data += 9;
+		if (sequence <= player.motion_sequence) {
+			data += 9 * pointers;
+			continue;
+		}
+		// Events sampled before this motion are handled first
+		if (!player.pending_input.empty()) {
+			handle_input(client, player, script);
+		}
+		ProfileScope scope(profiler, Phase::INPUT);
+		player.motion_sequence = sequence;
+		for (uint8_t j = 0; j < pointers; ++j) {
+			uint8_t pointer = data[0];
+			float x = read_float(data + 1);
+			float y = read_float(data + 5);
+			data += 9;
+			if (player.has_touch) {
+				script.on_finger_event(client, x, y, pointer, static_cast<uint8_t>(InputEventType::MOTION));
+			}
+			else {
+				script.on_mouse_motion(client, x, y);
+			}
+		}
+		if (wheel_x != 0.0f || wheel_y != 0.0f) {
+			script.on_mouse_wheel(client, wheel_x, wheel_y);
+		}
 	}
 }
@@ -3,68 +3,264 @@
 #ifndef ANOMALY_SERVER_SERVER_H
 #define ANOMALY_SERVER_SERVER_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <enet.h>
 
 #include <Anomaly.h>
+#include <Server/Config.h>
+#include <Server/Network.h>
+#include <Server/Profiler.h>
 #include <Server/Script.h>
+#include <Server/ThreadPool.h>
 
 class ContentManager;
 
 class Server {
 public:
-	Server(ContentManager& content, uint16_t port);
+	Server(ContentManager& content, Network& network, ThreadPool& pool, uint16_t room,
+		const Config& config);
 	Server(const Server&) = delete;
 	~Server();
 
 	Server& operator=(const Server&) = delete;
 
-	void update(Script& script, double dt);
+	void service(Script& script, uint32_t timeout);
+	void tick(Script& script, double dt);
+	void send();
 
-	void update_client_content(uint16_t client, ContentType type, uint32_t id, const std::vector<uint8_t>& data);
-	void update_content(ContentType type, uint32_t id, const std::vector<uint8_t>& data);
+	bool has_clients() const;
+
+	Profiler& get_profiler();
+
+	void update_manifest(const std::vector<ContentEntry>& entries);
 
 	bool start_text_input(uint16_t client);
 	bool stop_text_input(uint16_t client);
 	const char* get_composition(uint16_t client);
 
-	float get_sprite_width(const std::string& path);
+	bool get_net_stats(uint16_t client, ClientStats& stats);
+
+	float get_sprite_width(uint32_t id);
+	uint32_t get_content_id(ContentType type, std::string_view path) const;
+	bool has_content_id(ContentType type, uint32_t id) const;
 
-	int draw_sprite(uint16_t client, const std::string& path, float x, float y, float scale);
-	int draw_text(uint16_t client, const std::string& path, float x, float y, float scale,
-		uint8_t r, uint8_t g, uint8_t b, std::string text);
+	bool draw_sprite(uint16_t client, uint32_t id, float x, float y, float scale);
+	bool draw_text(uint16_t client, uint32_t id, float x, float y, float scale, uint8_t r,
+		uint8_t g, uint8_t b, std::string text);
+	bool draw_sprites(uint16_t client, std::vector<Sprite>& sprites);
+	int create_sprite(uint16_t client, uint32_t id, float x, float y, float scale,
+		uint32_t& handle);
+	int set_sprite_position(uint16_t client, uint32_t handle, float x, float y, float scale);
+	int set_sprite_visible(uint16_t client, uint32_t handle, bool visible);
+	int destroy_sprite(uint16_t client, uint32_t handle);
+	void draw_shared_sprite(uint32_t id, float x, float y, float scale);
+	void draw_shared_text(uint32_t id, float x, float y, float scale, uint8_t r, uint8_t g,
+		uint8_t b, std::string text);
+
+	int preload(uint16_t client, const std::string& path);
 
 	bool kick(uint16_t client);
 
-	int play(uint16_t client, const std::string& path, uint16_t channel, uint8_t volume);
-	int play_any(uint16_t client, const std::string& path, uint8_t volume);
+	bool play(uint16_t client, uint32_t id, uint16_t channel, uint8_t volume);
+	bool play_any(uint16_t client, uint32_t id, uint8_t volume);
 	bool stop(uint16_t client, uint16_t channel);
 	bool stop_all(uint16_t client);
+	void play_shared(uint32_t id, uint16_t channel, uint8_t volume);
+	void play_any_shared(uint32_t id, uint8_t volume);
 
 private:
+	const Config* config;
 	ContentManager* content;
-	ENetHost* host;
+	Network* network;
+	ThreadPool* pool;
+	uint16_t room;
+	Profiler profiler;
+
+	double simulation_time = 0.0;
+
+	struct Frame {
+		// The simulation time in milliseconds when the last tick ended
+		uint32_t time = 0;
+		std::vector<Sprite> sprites;
+		std::vector<Command> commands;
+		std::vector<AudioCommand> audio_commands;
+		// Content chunks, which are queued behind the frame's packets
+		std::vector<ENetPacket*> chunks;
+	};
+
+	struct Snapshot {
+		uint32_t number = 0;
+		std::vector<Sprite> sprites;
+		// Slots and generations of the strings defined in this frame
+		std::vector<std::pair<uint16_t, uint32_t>> defined;
+	};
+
+	struct StringSlot {
+		std::string text;
+		uint32_t generation = 0;
+		uint32_t last_used = 0;
+		uint32_t defined_in = 0;
+		bool confirmed = false;
+	};
+
+	// Encoder state of one stream of sprite frames, only touched by the encoder thread
+	struct Layer {
+		// The frames sent most recently, which can serve as baselines for delta encoding
+		std::array<Snapshot, SPRITE_HISTORY> history;
+		uint32_t frame_number = 0;
+		std::vector<uint8_t> buffer;
+		// Strings the receiver knows (or is about to know) by slot, texts are always sent
+		// inline if there are no slots
+		std::vector<StringSlot> strings;
+		std::unordered_map<std::string, uint16_t> string_slots;
+		uint32_t confirmed_frame = 0;
+	};
+
+	enum RetainedChange : uint8_t {
+		RETAINED_CREATED = 1,
+		RETAINED_MOVED = 2,
+		RETAINED_SHOWN = 4,
+		RETAINED_DESTROYED = 8
+	};
+
+	// A sprite that stays on the player's screen until it is destroyed, the ID is 0 for unused
+	// handles
+	struct RetainedSprite {
+		uint32_t id;
+		float x, y, scale;
+		bool visible;
+		uint8_t changes;
+	};
+
+	// Presses, releases and text input waiting for the motion sampled before them
+	struct PendingInput {
+		ENetPacket* packet;
+		uint32_t deadline;
+	};
+
+	// A blob being sent to a client, chunk by chunk
+	struct Transfer {
+		uint64_t hash;
+		uint32_t offset;
+	};
 
 	struct Client {
-		bool connected = false;
+		// Of the connection in the client's slot, so that nothing is sent to a later player
+		uint32_t generation;
 		bool has_touch;
-		ENetPeer* peer;
+		size_t active_index;
 		std::vector<Sprite> sprites;
+		std::vector<Sprite> frame_sprites;
 		std::vector<Command> commands;
 		std::vector<AudioCommand> audio_commands;
+		// Indexed by handle - 1, only the handles in changed_retained are sent with the next frame
+		std::vector<RetainedSprite> retained;
+		std::vector<uint32_t> free_retained;
+		std::vector<uint32_t> changed_retained;
+		// Only touched by the encoder thread while a frame is in flight
+		Frame sent;
+		Layer layer;
+		// The newest frames of both layers the client has received, written by the room thread.
+		// For the shared layer, the newest frame is in the upper 32 bits, the lower 32 bits have
+		// bit i set if the client also holds the frame i before it.
+		std::atomic<uint32_t> acked_frame;
+		std::atomic<uint64_t> acked_shared;
+		// The newest motion sample that has been handled
+		uint32_t motion_sequence;
+		std::deque<PendingInput> pending_input;
+		// Content IDs by type that have been announced, new ones are queued in manifest
+		std::array<std::vector<bool>, CONTENT_TYPES> announced;
+		std::vector<ContentEntry> manifest;
+		// Requested blobs, sent chunk by chunk within the content budget
+		std::deque<Transfer> transfers;
 		std::string composition;
 	};
 
-	std::vector<Client> clients;
+	struct EncodedPackets {
+		ENetPacket* sprites;
+		ENetPacket* commands;
+		ENetPacket* audio;
+	};
+
+	struct EncodingClient {
+		uint16_t id;
+		Client* client;
+	};
+
+	// Indexed by client ID, only joined clients are set
+	std::vector<std::unique_ptr<Client>> clients;
+	// IDs of all joined clients, so that per-tick work does not depend on max_clients
+	std::vector<uint16_t> active_clients;
+	std::vector<std::unique_ptr<Client>> free_clients;
+
+	// Drawn once for all clients of the room, composited below every client's own sprites
+	std::vector<Sprite> shared_sprites;
+	std::vector<Sprite> shared_frame_sprites;
+	std::vector<AudioCommand> shared_audio_commands;
+	Frame shared_sent;
+	Layer shared_layer;
+	EncodedPackets shared_encoded;
+	// Content used by the shared layer is announced to every client of the room
+	std::array<std::vector<bool>, CONTENT_TYPES> shared_announced;
+	std::vector<ContentEntry> shared_manifest;
+	std::vector<uint8_t> content_chunk;
+	// Content may be sent at content_rate for the time since the previous send
+	std::chrono::steady_clock::time_point last_send = std::chrono::steady_clock::now();
+
+	std::vector<EncodingClient> encoding;
+	std::vector<EncodedPackets> encoded;
+
+	std::mutex encoder_mutex;
+	std::condition_variable encoder_wake;
+	bool encoder_busy = false;
+	bool encoder_stop = false;
+	std::thread encoder;
+
+	void run_encoder();
+	void wait_for_encoder();
+	void encode_frame();
+
+	void encode_shared();
+
+	static ENetPacket* create_sprite_packet(Layer& layer, Frame& frame, uint32_t baseline,
+		uint8_t fraction_bits);
+	static void write_string(Layer& layer, Snapshot& snapshot, const std::string& text);
+	static ENetPacket* create_retained_packet(Client& client, uint8_t fraction_bits);
+	static ENetPacket* create_command_packet(const Frame& frame);
+	static ENetPacket* create_audio_packet(const Frame& frame);
+	static ENetPacket* create_manifest_packet(ContentPacket type,
+		const std::vector<ContentEntry>& entries);
+	static ENetPacket* create_chunk_packet(uint64_t hash, uint32_t size, uint32_t offset,
+		const std::vector<uint8_t>& chunk);
 
-	ENetPacket* create_sprite_packet(Client& client);
-	ENetPacket* create_command_packet(Client& client);
-	ENetPacket* create_audio_packet(Client& client);
-	static ENetPacket* create_content_packet(ContentType type, uint32_t id, const std::vector<uint8_t>& data);
+	Client* find_client(uint16_t client);
+	static RetainedSprite* find_retained(Client& client, uint32_t handle);
+	static void change_retained(Client& client, uint32_t handle, uint8_t change);
+	static bool mark_announced(std::vector<bool>& announced, uint32_t id);
+	void announce(Client& client, ContentType type, uint32_t id);
+	void announce_shared(ContentType type, uint32_t id);
+	void request_content(Client& client, ENetPacket* request);
+	void send_content(uint16_t id, Client& client, double budget);
+	void add_client(uint16_t client, uint32_t generation, bool has_touch);
+	void remove_client(uint16_t client);
 
-	void client_input(uint16_t client, ENetPacket* input_packet, Script& script);
+	void handle_event(Script& script, NetworkEvent& event);
+	void handle_input(uint16_t client, Client& player, Script& script);
+	void client_input(uint16_t client, Client& player, ENetPacket* input_packet, Script& script);
+	void client_motion(uint16_t client, Client& player, ENetPacket* motion_packet, Script& script);
 };
 
 #endif
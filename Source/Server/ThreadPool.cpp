@@ -0,0 +1,109 @@
+// Copyright 2023 Justus Zorn
+
+#include <Server/ThreadPool.h>
+
+ThreadPool::ThreadPool(size_t threads) {
+	for (size_t i = 0; i < threads; ++i) {
+		workers.push_back(std::make_unique<Worker>());
+	}
+	for (size_t i = 0; i < threads; ++i) {
+		this->threads.emplace_back(&ThreadPool::run, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		stop = true;
+	}
+	sleep.notify_all();
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)>& function) {
+	if (workers.empty() || count <= 1) {
+		for (size_t i = 0; i < count; ++i) {
+			function(i);
+		}
+		return;
+	}
+
+	Batch batch;
+	batch.function = &function;
+	batch.remaining = count;
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		queued += count;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		Worker& worker = *workers[i % workers.size()];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.tasks.push_back({ &batch, i });
+	}
+	sleep.notify_all();
+
+	Task task;
+	while (batch.remaining > 0) {
+		if (pop(workers.size(), task)) {
+			execute(task);
+		}
+		else {
+			std::unique_lock<std::mutex> lock(batch.mutex);
+			batch.done.wait(lock, [&batch] { return batch.remaining == 0; });
+		}
+	}
+	// The last task signals completion while holding the lock, wait for it to let go before the
+	// batch goes out of scope
+	std::lock_guard<std::mutex> lock(batch.mutex);
+}
+
+void ThreadPool::run(size_t worker) {
+	Task task;
+	while (true) {
+		if (pop(worker, task)) {
+			execute(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		sleep.wait(lock, [this] { return stop || queued > 0; });
+		if (stop) {
+			return;
+		}
+	}
+}
+
+bool ThreadPool::pop(size_t worker, Task& task) {
+	// Take the oldest task of our own deque first, then steal the newest one of another worker
+	if (worker < workers.size()) {
+		Worker& own = *workers[worker];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			task = own.tasks.front();
+			own.tasks.pop_front();
+			--queued;
+			return true;
+		}
+	}
+	for (size_t i = 1; i <= workers.size(); ++i) {
+		Worker& victim = *workers[(worker + i) % workers.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			task = victim.tasks.back();
+			victim.tasks.pop_back();
+			--queued;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::execute(Task& task) {
+	Batch* batch = task.batch;
+	(*batch->function)(task.index);
+	std::lock_guard<std::mutex> lock(batch->mutex);
+	if (--batch->remaining == 0) {
+		batch->done.notify_all();
+	}
+}
@@ -0,0 +1,58 @@
+// Copyright 2023 Justus Zorn
+
+#ifndef ANOMALY_SERVER_THREAD_POOL_H
+#define ANOMALY_SERVER_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker has its own task deque and steals from the others once
+// it runs dry; the thread waiting for a parallel_for helps out in the same way.
+class ThreadPool {
+public:
+	ThreadPool(size_t threads);
+	ThreadPool(const ThreadPool&) = delete;
+	~ThreadPool();
+
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void parallel_for(size_t count, const std::function<void(size_t)>& function);
+
+private:
+	struct Batch {
+		const std::function<void(size_t)>* function;
+		std::atomic<size_t> remaining;
+		std::mutex mutex;
+		std::condition_variable done;
+	};
+
+	struct Task {
+		Batch* batch;
+		size_t index;
+	};
+
+	struct Worker {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+
+	std::mutex sleep_mutex;
+	std::condition_variable sleep;
+	std::atomic<size_t> queued = 0;
+	bool stop = false;
+
+	void run(size_t worker);
+	bool pop(size_t worker, Task& task);
+	void execute(Task& task);
+};
+
+#endif